@@ -81,6 +81,12 @@ struct DirectoryEntry {
     unsigned int size;
 };
 
+// A run of consecutive clusters belonging to the same cluster chain
+struct Extent {
+    unsigned int cluster;
+    unsigned int count;
+};
+
 // Long File Name Directory Entry
 struct LFNDirectoryEntry {
     unsigned char order;
@@ -126,6 +132,20 @@ void read(T* result, std::ifstream& in) {
     *result = r;
 }
 
+// The opposite of read(): writes the value in little endian
+template <class T>
+void write(T value, std::ostream& out) {
+    int size = sizeof(T);
+    unsigned char bytes[sizeof(T)];
+
+    for (int i = 0; i < size; i++) {
+        bytes[i] = value & 0xFF;
+        value >>= 8;
+    }
+
+    out.write((char*)bytes, size);
+}
+
 Time convertToTime(unsigned short time) {
     Time result;
     result.hour = time & 0b1111;
@@ -157,22 +177,8 @@ Date convertToDate(unsigned short date) {
     return result;
 }
 
-void readLFNPart(std::ifstream& in, std::string& buffer, int length) {
-    int i = 0;
-    for (i = 0; i<length/2; i++) {
-        unsigned char c;
-        read(&c, in);
-        if (c == 0x00 || c == 0xFF) break;
-        buffer.push_back(c);
-        in.ignore();
-    }
-
-    // If we finished before we read all the bytes, we should read them now
-    in.ignore(length-i*2-1);
-}
-
-std::string computeSizeString(int size) {
-    int power = floor(log10((double)size) / log10(1024));
+std::string computeSizeString(unsigned long long size) {
+    int power = size == 0 ? 0 : floor(log10((double)size) / log10(1024));
     float scaledSize = size / pow(1024, power);
     std::ostringstream stream;
     stream.precision(2);
@@ -200,92 +206,118 @@ std::string computeSizeString(int size) {
     return result;
 }
 
-int composeCluster(unsigned short clusterHigh, unsigned short clusterLow) {
-    return (clusterHigh << 16) | clusterLow;
+unsigned int composeCluster(unsigned short clusterHigh, unsigned short clusterLow) {
+    return ((unsigned int)clusterHigh << 16) | clusterLow;
+}
+
+// Sector and byte offsets are 64-bit: a FAT32 volume can be several terabytes,
+// while the numbers stored in the BPB are only 32-bit on their own
+unsigned long long getTotalSectors(BPB bpb) {
+    return (bpb.sectorsCount == 0) ? bpb.sectorsCount_large : bpb.sectorsCount;
 }
 
-int getClusterAddress(BPB bpb, unsigned int sectorsPerFAT, int cluster) {
-    const int rootEntrySectors = (bpb.rootDirectoryEntries * 32 + (bpb.bytesPerSector - 1)) / bpb.bytesPerSector;
-    const int firstDataSector = bpb.reservedSectors + (bpb.FATs * sectorsPerFAT) + rootEntrySectors;
-    return ((cluster - 2) * bpb.sectorsPerCluster + firstDataSector) *
+unsigned long long getFirstDataSector(BPB bpb, unsigned int sectorsPerFAT) {
+    const unsigned long long rootEntrySectors = ((unsigned long long)bpb.rootDirectoryEntries * 32 + (bpb.bytesPerSector - 1)) / bpb.bytesPerSector;
+    return bpb.reservedSectors + (unsigned long long)bpb.FATs * sectorsPerFAT + rootEntrySectors;
+}
+
+unsigned long long getClusterAddress(BPB bpb, unsigned int sectorsPerFAT, unsigned int cluster) {
+    return ((unsigned long long)(cluster - 2) * bpb.sectorsPerCluster + getFirstDataSector(bpb, sectorsPerFAT)) *
          bpb.bytesPerSector;
 }
 
-bool readDirectoryEntry(std::ifstream &in,
-                        std::vector<DirectoryEntry> &result) {
-  std::vector<std::string> longNameEntries;
-  bool run = false;
-
-  do {
-    unsigned char firstByte, eleventhByte;
-    int origin = in.tellg();
-    read(&firstByte, in);
-    in.seekg((int)in.tellg() + 10);
-    read(&eleventhByte, in);
-    in.seekg(origin); // go back, so we can read the data again
-
-
-    // long filename entry
-    if (eleventhByte == 0x0F) {
-        std::string longNameBuffer;
-        LFNDirectoryEntry entry;
-        read(&entry.order, in);
-        // We read the top name
-        readLFNPart(in, longNameBuffer, 10);
-        in.ignore(); // the eleventh byte
-        read(&entry.longEntryType, in);
-        read(&entry.checksum, in);
-        // Middle name
-        readLFNPart(in, longNameBuffer, 12);
-        in.ignore(2); // always zero
-        // Bottom name
-        readLFNPart(in, longNameBuffer, 4);
-
-        longNameEntries.push_back(longNameBuffer);
-
-        run = true;
-        continue;
+// Number of clusters in the data region (cluster numbers go from 2 to this + 1)
+unsigned int countClusters(BPB bpb, unsigned int sectorsPerFAT) {
+    const unsigned long long totalSectors = getTotalSectors(bpb);
+    const unsigned long long firstDataSector = getFirstDataSector(bpb, sectorsPerFAT);
+    if (totalSectors <= firstDataSector || bpb.sectorsPerCluster == 0) return 0;
+    return std::min<unsigned long long>((totalSectors - firstDataSector) / bpb.sectorsPerCluster, 0xFFFFFFFD);
+}
+
+// Where the 13 UTF-16 code units of a long filename entry are stored in the slot
+const int LFN_NAME_OFFSETS[] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+// The code units stored in a long filename slot, up to the terminator
+std::u16string parseLongNamePart(const unsigned char* slot) {
+    std::u16string part;
+    for (int i = 0; i < 13; i++) {
+        const char16_t c = slot[LFN_NAME_OFFSETS[i]] | (slot[LFN_NAME_OFFSETS[i] + 1] << 8);
+        if (c == 0x0000 || c == 0xFFFF) break;
+        part.push_back(c);
     }
-    // test the first byte
-    // end of directory
-    if (firstByte == 0x00) return false;
-    // unused entry
-    if (firstByte == 0xE5) {
-        // go to the next entry
-        in.seekg((int)in.tellg() + 32);
-        continue;
+    return part;
+}
+
+// Long filenames are stored as UTF-16 and shown as UTF-8. Unpaired surrogates become U+FFFD.
+std::string toUTF8(const std::u16string& text) {
+    std::string result;
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned int c = text[i];
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < text.size() && text[i + 1] >= 0xDC00 && text[i + 1] < 0xE000)
+            c = 0x10000 + ((c - 0xD800) << 10) + (text[++i] - 0xDC00);
+        else if (c >= 0xD800 && c < 0xE000)
+            c = 0xFFFD;
+
+        if (c < 0x80) result.push_back(c);
+        else if (c < 0x800) {
+            result.push_back(0xC0 | (c >> 6));
+            result.push_back(0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            result.push_back(0xE0 | (c >> 12));
+            result.push_back(0x80 | ((c >> 6) & 0x3F));
+            result.push_back(0x80 | (c & 0x3F));
+        } else {
+            result.push_back(0xF0 | (c >> 18));
+            result.push_back(0x80 | ((c >> 12) & 0x3F));
+            result.push_back(0x80 | ((c >> 6) & 0x3F));
+            result.push_back(0x80 | (c & 0x3F));
+        }
+    }
+    return result;
+}
+
+// Converts a UTF-8 name to UTF-16. Returns false if it isn't valid UTF-8.
+bool toUTF16(const std::string& text, std::u16string& result) {
+    result.clear();
+    for (size_t i = 0; i < text.size();) {
+        const unsigned char first = text[i];
+        const int length = first < 0x80 ? 1 : (first & 0xE0) == 0xC0 ? 2 : (first & 0xF0) == 0xE0 ? 3 : (first & 0xF8) == 0xF0 ? 4 : 0;
+        if (length == 0 || i + length > text.size()) return false;
+
+        unsigned int c = length == 1 ? first : first & (0x7F >> length);
+        for (int j = 1; j < length; j++) {
+            const unsigned char next = text[i + j];
+            if ((next & 0xC0) != 0x80) return false;
+            c = (c << 6) | (next & 0x3F);
+        }
+        // overlong forms, surrogates and values past U+10FFFF aren't allowed
+        const unsigned int smallest[] = {0, 0, 0x80, 0x800, 0x10000};
+        if (c < smallest[length] || c > 0x10FFFF || (c >= 0xD800 && c < 0xE000)) return false;
+        i += length;
+
+        if (c < 0x10000) result.push_back(c);
+        else {
+            result.push_back(0xD800 + ((c - 0x10000) >> 10));
+            result.push_back(0xDC00 + ((c - 0x10000) & 0x3FF));
+        }
     }
+    return true;
+}
 
-    DirectoryEntry entry;
-    in.read((char *)&entry.filename, 11);
+// Fills the entry from a 32-byte 8.3 slot. The long filename is left as it is.
+void parseShortEntry(const unsigned char* slot, DirectoryEntry& entry) {
+    memcpy(entry.filename, slot, 11);
     entry.filename[11] = '\0';
-    read(&entry.attributes, in);
-    in.ignore(); // Reserved
-    read(&entry.creationTimeHS, in);
-    read(&entry.creationTime, in);
-    read(&entry.creationDate, in);
-    read(&entry.lastAccessedDate, in);
-    read(&entry.firstClusterHigh, in);
-    read(&entry.lastModificationTime, in);
-    read(&entry.lastModificationDate, in);
-    read(&entry.firstClusterLow, in);
-    read(&entry.size, in);
-
-    if (!longNameEntries.empty()) {
-      // iterate through the entries backwards and add them to string
-      std::string filename;
-
-      for (int i = longNameEntries.size() - 1; i >= 0; i--) {
-        filename += longNameEntries.at(i);
-      }
-
-      entry.longFilename = filename;
-    }
-    result.push_back(entry);
-    run = false;
-    
-  } while (run);
-  return true;
+    entry.attributes = slot[11];
+    entry.creationTimeHS = slot[13];
+    entry.creationTime = slot[14] | (slot[15] << 8);
+    entry.creationDate = slot[16] | (slot[17] << 8);
+    entry.lastAccessedDate = slot[18] | (slot[19] << 8);
+    entry.firstClusterHigh = slot[20] | (slot[21] << 8);
+    entry.lastModificationTime = slot[22] | (slot[23] << 8);
+    entry.lastModificationDate = slot[24] | (slot[25] << 8);
+    entry.firstClusterLow = slot[26] | (slot[27] << 8);
+    entry.size = slot[28] | (slot[29] << 8) | (slot[30] << 16) | ((unsigned int)slot[31] << 24);
 }
 
 void printBPBInfo(BPB bpb) {
@@ -411,5 +443,35 @@ inline void rtrim(std::string &s) {
     }).base(), s.end());
 }
 
+// The name that is shown to the user: the long filename if there is one, or else the 8.3 name
+std::string getEntryName(const DirectoryEntry& entry) {
+    std::string name;
+    if (!entry.longFilename.empty())
+        name = entry.longFilename;
+    else
+        name = std::string((char*)entry.filename);
+    rtrim(name);
+    return name;
+}
+
+// The 8.3 name written with a dot ("README.TXT")
+std::string getShortName(const DirectoryEntry& entry) {
+    std::string base((char*)entry.filename, 8), extension((char*)entry.filename + 8, 3);
+    rtrim(base);
+    rtrim(extension);
+    return extension.empty() ? base : base + "." + extension;
+}
+
+// Checks the name against the long filename, the raw 8.3 name and the 8.3 name written with a dot ("README.TXT")
+bool matchesName(const DirectoryEntry& entry, const std::string& name) {
+    if (getEntryName(entry) == name) return true;
+
+    const std::string shortName = getShortName(entry);
+    if (shortName.size() != name.size()) return false;
+
+    for (size_t i = 0; i < name.size(); i++)
+        if (std::toupper((unsigned char)name[i]) != (unsigned char)shortName[i]) return false;
+    return true;
+}
 
 #endif
\ No newline at end of file
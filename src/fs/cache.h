@@ -0,0 +1,324 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "../extras.h"
+#include <istream>
+#include <map>
+#include <ostream>
+#include <set>
+#include <vector>
+
+// In-memory view of the FAT, loaded one sector at a time.
+// Changes are kept in memory until flush(), which writes the modified sectors
+// in batches of consecutive sectors to every FAT copy.
+class FATCache {
+public:
+    FATCache(std::istream& in, FSType fsType, BPB bpb, unsigned int sectorsPerFAT)
+        : in(in), fsType(fsType), bpb(bpb), sectorsPerFAT(sectorsPerFAT),
+          clusters(countClusters(bpb, sectorsPerFAT)), sectorWrites(0), lastSector(0), lastData(nullptr) {}
+
+    unsigned int get(unsigned int cluster) {
+        switch (fsType) {
+        case FAT32:
+            return getBytes(cluster * 4, 4) & 0x0FFFFFFF; // only 28 bits are used
+        case FAT16:
+            return getBytes(cluster * 2, 2);
+        default: {
+            unsigned int value = getBytes(cluster + cluster / 2, 2); // 1.5 bytes per entry
+            return (cluster & 1) ? value >> 4 : value & 0xFFF;
+        }
+        }
+    }
+
+    void set(unsigned int cluster, unsigned int value) {
+        switch (fsType) {
+        case FAT32:
+            // the top 4 bits are reserved and must be preserved
+            setBytes(cluster * 4, 4, (getBytes(cluster * 4, 4) & 0xF0000000) | (value & 0x0FFFFFFF));
+            break;
+        case FAT16:
+            setBytes(cluster * 2, 2, value & 0xFFFF);
+            break;
+        default: {
+            const unsigned int offset = cluster + cluster / 2;
+            unsigned int old = getBytes(offset, 2);
+            if (cluster & 1) setBytes(offset, 2, (old & 0x000F) | ((value & 0xFFF) << 4));
+            else setBytes(offset, 2, (old & 0xF000) | (value & 0xFFF));
+        }
+        }
+    }
+
+    // The value that marks the end of a cluster chain when writing
+    unsigned int endOfChain() const {
+        return fsType == FAT32 ? 0x0FFFFFFF : (fsType == FAT16 ? 0xFFFF : 0xFFF);
+    }
+
+    bool isEndOfChain(unsigned int value) const {
+        return value >= (fsType == FAT32 ? 0x0FFFFFF8 : (fsType == FAT16 ? 0xFFF8 : 0xFF8));
+    }
+
+    bool isBad(unsigned int value) const {
+        return value == (fsType == FAT32 ? 0x0FFFFFF7 : (fsType == FAT16 ? 0xFFF7 : 0xFF7));
+    }
+
+    // The first invalid cluster number
+    unsigned int limit() const { return clusters + 2; }
+
+    bool isDirty() const { return !dirty.empty(); }
+
+    // Writes every modified sector to all the FATs.
+    // Consecutive dirty sectors are written with a single write per FAT copy.
+    void flush(std::ostream& out) {
+        std::vector<char> batch;
+        std::set<unsigned int>::iterator it = dirty.begin();
+
+        while (it != dirty.end()) {
+            const unsigned int first = *it;
+            unsigned int last = first;
+            batch.clear();
+
+            // collect the run of consecutive sectors
+            while (it != dirty.end() && *it == last + (batch.empty() ? 0 : 1)) {
+                last = *it;
+                const std::vector<unsigned char>& data = sectors[last];
+                batch.insert(batch.end(), data.begin(), data.end());
+                ++it;
+            }
+
+            for (int copy = 0; copy < bpb.FATs; copy++) {
+                const unsigned long long FATStart = (unsigned long long)(bpb.reservedSectors + copy * sectorsPerFAT) * bpb.bytesPerSector;
+                out.seekp(FATStart + (unsigned long long)first * bpb.bytesPerSector);
+                out.write(batch.data(), batch.size());
+                sectorWrites++;
+            }
+        }
+
+        out.flush();
+        dirty.clear();
+    }
+
+    // Number of write calls made to the FATs so far
+    unsigned long long writes() const { return sectorWrites; }
+
+private:
+    std::vector<unsigned char>& loadSector(unsigned int sector) {
+        // consecutive entries are almost always in the same sector
+        if (lastData && lastSector == sector) return *lastData;
+
+        std::map<unsigned int, std::vector<unsigned char>>::iterator found = sectors.find(sector);
+        if (found != sectors.end()) {
+            lastSector = sector;
+            lastData = &found->second;
+            return found->second;
+        }
+
+        // chains are usually followed forward, so the next sectors are read in the same call
+        unsigned int count = 1;
+        while (count < READ_AHEAD && sector + count < sectorsPerFAT && !sectors.count(sector + count)) count++;
+
+        std::vector<unsigned char> buffer((size_t)count * bpb.bytesPerSector);
+        in.clear();
+        in.seekg((unsigned long long)(bpb.reservedSectors + sector) * bpb.bytesPerSector);
+        in.read((char*)buffer.data(), buffer.size());
+
+        for (unsigned int i = 0; i < count; i++) {
+            std::vector<unsigned char>::iterator start = buffer.begin() + (size_t)i * bpb.bytesPerSector;
+            sectors[sector + i].assign(start, start + bpb.bytesPerSector);
+        }
+
+        lastSector = sector;
+        lastData = &sectors[sector];
+        return *lastData;
+    }
+
+    static const unsigned int READ_AHEAD = 64; // sectors
+
+    // Little endian value of `size` bytes at `offset` in the FAT (may cross a sector boundary on FAT12)
+    unsigned int getBytes(unsigned int offset, int size) {
+        unsigned int value = 0;
+        for (int i = size - 1; i >= 0; i--) {
+            const unsigned int position = offset + i;
+            value <<= 8;
+            value |= loadSector(position / bpb.bytesPerSector)[position % bpb.bytesPerSector];
+        }
+        return value;
+    }
+
+    void setBytes(unsigned int offset, int size, unsigned int value) {
+        for (int i = 0; i < size; i++) {
+            const unsigned int position = offset + i;
+            const unsigned int sector = position / bpb.bytesPerSector;
+            loadSector(sector)[position % bpb.bytesPerSector] = value & 0xFF;
+            dirty.insert(sector);
+            value >>= 8;
+        }
+    }
+
+    std::istream& in;
+    FSType fsType;
+    BPB bpb;
+    unsigned int sectorsPerFAT;
+    unsigned int clusters;
+
+    std::map<unsigned int, std::vector<unsigned char>> sectors; // sector number (relative to the FAT) -> data
+    std::set<unsigned int> dirty;
+    unsigned long long sectorWrites;
+
+    unsigned int lastSector;
+    std::vector<unsigned char>* lastData;
+};
+
+// Splits the cluster chain starting at firstCluster into runs of consecutive clusters
+void readExtents(FATCache& fat, unsigned int firstCluster, std::vector<Extent>& extents) {
+    const size_t start = extents.size(); // extents that were already in the vector belong to other chains
+    unsigned int cluster = firstCluster;
+    unsigned int visited = 0;
+
+    while (cluster >= 2 && cluster < fat.limit()) {
+        if (extents.size() > start && extents.back().cluster + extents.back().count == cluster)
+            extents.back().count++;
+        else
+            extents.push_back({cluster, 1});
+
+        // a chain can't be longer than the volume, so we must be in a loop
+        if (++visited > fat.limit()) {
+            std::cerr << "cluster chain loops at cluster " << cluster << std::endl;
+            return;
+        }
+
+        unsigned int next = fat.get(cluster);
+        if (fat.isBad(next)) {
+            std::cerr << "bad cluster in chain after cluster " << cluster << std::endl;
+            return;
+        }
+        if (fat.isEndOfChain(next)) return;
+        cluster = next;
+    }
+}
+
+// Finds `count` free clusters, starting the search at `hint`.
+// A single contiguous run is preferred; if the volume has none that is big enough,
+// the free clusters are taken in order from the hint. The clusters are not linked.
+bool allocateClusters(FATCache& fat, unsigned int count, unsigned int hint, std::vector<Extent>& extents) {
+    const unsigned int limit = fat.limit();
+    if (count == 0) return true;
+    if (hint < 2 || hint >= limit) hint = 2;
+
+    std::vector<Extent> fragments;
+    unsigned int found = 0;
+    Extent run = {0, 0};
+
+    for (unsigned int scanned = 0; scanned < limit - 2; scanned++) {
+        unsigned int cluster = hint + scanned;
+        if (cluster >= limit) cluster -= limit - 2; // wrap around
+
+        const bool isFree = fat.get(cluster) == 0;
+
+        // a run ends at a used cluster, or when the search wraps around
+        if (run.count > 0 && (!isFree || cluster != run.cluster + run.count)) {
+            if (found < count) {
+                fragments.push_back(run);
+                found += run.count;
+            }
+            run.count = 0;
+        }
+        if (!isFree) continue;
+
+        if (run.count == 0) run.cluster = cluster;
+        if (++run.count == count) {
+            extents.push_back(run);
+            return true;
+        }
+    }
+    if (run.count > 0 && found < count) {
+        fragments.push_back(run);
+        found += run.count;
+    }
+
+    if (found < count) return false;
+
+    for (size_t i = 0; i < fragments.size() && count > 0; i++) {
+        Extent extent = fragments[i];
+        if (extent.count > count) extent.count = count;
+        extents.push_back(extent);
+        count -= extent.count;
+    }
+    return true;
+}
+
+// Reads the whole first FAT, a large block at a time, and collects the runs of free clusters.
+// Much faster than FATCache::get() for every cluster on big volumes, and nothing is kept in memory.
+// Returns the number of free clusters.
+unsigned int findFreeExtents(std::istream& in, FSType fsType, BPB bpb, unsigned int sectorsPerFAT, std::vector<Extent>& extents) {
+    const unsigned int limit = countClusters(bpb, sectorsPerFAT) + 2;
+    const unsigned int entriesPerBlock = 1 << 18; // a multiple of 2, so FAT12 entries never cross blocks
+    const unsigned long long bitsPerEntry = fsType == FAT32 ? 32 : (fsType == FAT16 ? 16 : 12);
+    std::vector<unsigned char> block(entriesPerBlock * bitsPerEntry / 8);
+    unsigned int freeClusters = 0;
+    Extent run = {0, 0}; // the run of free clusters being collected
+
+    in.clear();
+    for (unsigned int first = 0; first < limit; first += entriesPerBlock) {
+        const unsigned int count = std::min(entriesPerBlock, limit - first);
+        in.seekg((unsigned long long)bpb.reservedSectors * bpb.bytesPerSector + first * bitsPerEntry / 8);
+        in.read((char*)block.data(), (count * bitsPerEntry + 7) / 8);
+        if (!in) {
+            std::cerr << "could not read the FAT" << std::endl;
+            in.clear();
+            break;
+        }
+
+        const unsigned char* entries = block.data();
+        for (unsigned int i = first < 2 ? 2 - first : 0; i < count; i++) {
+            // only whether the entry is 0 matters, so the bytes don't need to be put together
+            unsigned int value;
+            if (fsType == FAT32) value = (entries[i * 4] | entries[i * 4 + 1] | entries[i * 4 + 2] | (entries[i * 4 + 3] & 0x0F));
+            else if (fsType == FAT16) value = entries[i * 2] | entries[i * 2 + 1];
+            else {
+                const unsigned int offset = i + i / 2;
+                value = entries[offset] | entries[offset + 1] << 8;
+                value = (i & 1) ? value >> 4 : value & 0xFFF;
+            }
+
+            if (value != 0) {
+                if (run.count > 0) extents.push_back(run);
+                run.count = 0;
+                continue;
+            }
+            if (run.count == 0) run.cluster = first + i;
+            run.count++;
+            freeClusters++;
+        }
+    }
+    if (run.count > 0) extents.push_back(run);
+    return freeClusters;
+}
+
+// Links the extents into a single chain, appending it after `previous` (0 to start a new chain)
+void linkExtents(FATCache& fat, const std::vector<Extent>& extents, unsigned int previous) {
+    for (size_t i = 0; i < extents.size(); i++) {
+        for (unsigned int j = 0; j < extents[i].count; j++) {
+            const unsigned int cluster = extents[i].cluster + j;
+            if (previous != 0) fat.set(previous, cluster);
+            previous = cluster;
+        }
+    }
+    if (previous != 0) fat.set(previous, fat.endOfChain());
+}
+
+// Marks every cluster of the chain as free and returns how many were freed
+unsigned int freeChain(FATCache& fat, unsigned int firstCluster) {
+    std::vector<Extent> extents;
+    readExtents(fat, firstCluster, extents);
+
+    unsigned int freed = 0;
+    for (size_t i = 0; i < extents.size(); i++) {
+        for (unsigned int j = 0; j < extents[i].count; j++) {
+            fat.set(extents[i].cluster + j, 0);
+            freed++;
+        }
+    }
+    return freed;
+}
+
+#endif
@@ -1,24 +1,14 @@
 #ifndef COMMON_FS_H
 #define COMMON_FS_H
 #include "../extras.h"
-#include "fat12.h"
-#include "fat16.h"
 #include "fat32.h"
+#include "io.h"
 #include <fstream>
 #include <ios>
 #include <vector>
 
-// we set the End Of Cluster Chain value for each filesystem
-const int EOCC32 = 0x0FFFFFF8;
-const int EOCC16 = 0x0000FFF8;
-const int EOCC12 = 0x00000FF8;
-
-// we set the Bad Cluster value for each filesystem
-const int BAD_CLUSTER32 = 0x0FFFFFF7;
-const int BAD_CLUSTER16 = 0x0000FFF7;
-const int BAD_CLUSTER12 = 0x00000FF7;
-
-void readBPB(BPB *bpb, std::ifstream &in) {
+// Returns false if the drive is too small to have a boot sector
+bool readBPB(BPB *bpb, std::ifstream &in) {
   in.read((char *)bpb->jmp, 3);
   in.read((char *)bpb->oem, 8);
   bpb->oem[8] = '\0';
@@ -34,89 +24,39 @@ void readBPB(BPB *bpb, std::ifstream &in) {
   read(&bpb->headsCount, in);
   read(&bpb->hiddenSectors, in);
   read(&bpb->sectorsCount_large, in);
+  return in.good();
 }
 
-int getNextCluster(FSType fsType, BPB bpb, std::ifstream &in, int cluster) {
-  switch (fsType) {
-  case FAT32:
-    return fat32::getNextCluster(in, bpb, cluster);
-  case FAT16:
-    return fat16::getNextCluster(in, bpb, cluster);
-  case FAT12:
-    return fat12::getNextCluster(in, bpb, cluster);
-  default:
-    return 0;
-  }
-}
-
-void readFile(FSType fsType, BPB bpb, unsigned int sectorsPerFAT,
-              DirectoryEntry entry, std::ifstream &in) {
-  const int firstCluster = composeCluster(entry.firstClusterHigh, entry.firstClusterLow);
-  const int bytesPerCluster = bpb.sectorsPerCluster * bpb.bytesPerSector;
-  unsigned char clusterData[bytesPerCluster + 1];
-
-  // get the appropriate values for each filesystem
-  const int EOCC_VALUE = fsType == FAT32 ? EOCC32 : (fsType == FAT16 ? EOCC16 : EOCC12);
-  const int BAD_CLUSTER_VALUE = fsType == FAT32 ? BAD_CLUSTER32 : (fsType == FAT16 ? BAD_CLUSTER16 : BAD_CLUSTER12);
+// Prints the contents of a file. Each extent is read with as few reads as the buffers allow.
+void readFile(BPB bpb, unsigned int sectorsPerFAT, DirectoryEntry entry, const std::vector<Extent> &extents,
+              DataReader &reader, BufferPool &pool) {
+  const unsigned long long bytesPerCluster = bpb.sectorsPerCluster * bpb.bytesPerSector;
+  unsigned long long remaining = entry.size;
 
-  int currentCluster = firstCluster;
+  PooledBuffer buffer(pool);
+  if (!buffer.get()) {
+    std::cerr << "no free buffer to read the file" << std::endl;
+    return;
+  }
 
-  while (true) {
-    in.seekg(getClusterAddress(bpb, sectorsPerFAT, currentCluster));
-    in.read((char *)&clusterData, bytesPerCluster);
-    clusterData[bytesPerCluster] = '\0';
+  for (size_t i = 0; i < extents.size() && remaining > 0; i++) {
+    unsigned long long position = getClusterAddress(bpb, sectorsPerFAT, extents[i].cluster);
+    unsigned long long length = std::min<unsigned long long>(remaining, extents[i].count * bytesPerCluster);
+    remaining -= length;
 
-    std::cout << clusterData;
+    while (length > 0) {
+      const size_t chunk = std::min<unsigned long long>(length, pool.maxRead());
+      const unsigned char *data = reader.read(position, chunk, buffer.get());
+      if (!data) return;
 
-    int nextCluster = getNextCluster(fsType, bpb, in, currentCluster);
-    if (nextCluster >= EOCC_VALUE) {
-      std::cout << std::endl << "end of file" << std::endl;
-      break;
-    } else if (nextCluster == BAD_CLUSTER_VALUE) {
-      std::cerr << "bad cluster - stopping" << std::endl;
-      break;
+      std::cout.write((const char *)data, chunk);
+      position += chunk;
+      length -= chunk;
     }
-    currentCluster = nextCluster;
-  }
-}
-
-// This function isn't in any namespace because it will be used by both FAT16 and FAT12
-void readDirectory(FSType fsType, std::ifstream& in, BPB bpb, int cluster, std::vector<DirectoryEntry>& entries) {
-  // Only for FAT16/12. FAT32 has its own function in its own namespace
-  if (fsType == FAT32) return;
-
-  const int EOCC_VALUE = fsType == FAT16 ? EOCC16 : EOCC12;
-  const int BAD_CLUSTER_VALUE = fsType == FAT16 ? BAD_CLUSTER16 : BAD_CLUSTER12;
-
-  int position;
-  if (cluster == -1) {
-    const int firstFATSector = bpb.reservedSectors;
-    const int FATSize = bpb.sectorsPerFAT * bpb.FATs * bpb.bytesPerSector; // FAT size in bytes
-    // The root directory on FAT12/16 is immediately after the FAT
-    position = firstFATSector * bpb.bytesPerSector + FATSize;
-  } else {
-    position = getClusterAddress(bpb, bpb.sectorsPerFAT, cluster);
   }
 
-  in.seekg(position);
-  while (true) {
-    bool hasMore = readDirectoryEntry(in, entries);
-    if (!hasMore) break;
-
-    if ((int)in.tellg() - position >= bpb.sectorsPerCluster * bpb.bytesPerSector) {
-      // if we read more than one cluster go to the next
-      int nextCluster = getNextCluster(fsType, bpb, in, cluster);
-      if (nextCluster == EOCC_VALUE) return; // end of cluster chain
-      else if (nextCluster == BAD_CLUSTER_VALUE) {
-        // bad cluster
-        std::cerr << "bad cluster while reading directory" << std::endl;
-        return;
-      }
-
-      position = getClusterAddress(bpb, bpb.sectorsPerFAT, cluster);
-      in.seekg(position);
-    }
-  }
+  if (remaining > 0) std::cerr << "the cluster chain is shorter than the file - stopping" << std::endl;
+  else std::cout << std::endl << "end of file" << std::endl;
 }
 
 // Common function for reading the EBPB on FAT16 and FAT12
@@ -136,19 +76,14 @@ void readEBPB(EBPB* ebpb, std::ifstream& in) {
 }
 
 FSType detectFSType(BPB bpb) {
-  int totalSectors =
-      (bpb.sectorsCount == 0) ? bpb.sectorsCount_large : bpb.sectorsCount;
-  int sectorsPerFAT = bpb.sectorsPerFAT;
+  const unsigned int sectorsPerFAT = bpb.sectorsPerFAT;
   if (sectorsPerFAT == 0)
     return FAT32; // Only FAT16 and FAT12 have this value set
-  int rootDirectorySize =
-      ((bpb.rootDirectoryEntries * 32) + (bpb.bytesPerSector - 1)) /
-      bpb.bytesPerSector; // Root directory size in sectors
+  if (bpb.bytesPerSector == 0 || bpb.sectorsPerCluster == 0)
+    return FAT12; // checkGeometry() rejects it anyway
 
-  int dataSectors =
-      totalSectors -
-      (bpb.reservedSectors + (bpb.FATs * sectorsPerFAT) + rootDirectorySize);
-  int totalClusters = dataSectors / bpb.sectorsPerCluster;
+  // the number of clusters is computed in 64 bits and is 0 if the metadata doesn't fit in the volume
+  const unsigned int totalClusters = countClusters(bpb, sectorsPerFAT);
 
   if (totalClusters < 4085)
     return FAT12;
@@ -158,4 +93,45 @@ FSType detectFSType(BPB bpb) {
     return FAT32;
 }
 
+// Checks that the numbers in the boot sector describe a volume that can exist, so that no offset
+// computed from them can overflow or point outside of the FAT. Returns false (and says why) if they don't.
+bool checkGeometry(FSType fsType, BPB bpb, unsigned int sectorsPerFAT, unsigned int rootCluster, unsigned long long driveSize) {
+  const unsigned short bytesPerSector = bpb.bytesPerSector;
+  if (bytesPerSector != 512 && bytesPerSector != 1024 && bytesPerSector != 2048 && bytesPerSector != 4096) {
+    std::cerr << "invalid number of bytes per sector: " << bytesPerSector << std::endl;
+    return false;
+  }
+  if (bpb.sectorsPerCluster == 0 || (bpb.sectorsPerCluster & (bpb.sectorsPerCluster - 1)) != 0) {
+    std::cerr << "invalid number of sectors per cluster: " << (int)bpb.sectorsPerCluster << std::endl;
+    return false;
+  }
+  if (bpb.reservedSectors == 0 || bpb.FATs == 0 || sectorsPerFAT == 0) {
+    std::cerr << "the boot sector has no reserved sectors or no FAT" << std::endl;
+    return false;
+  }
+
+  const unsigned long long totalSectors = getTotalSectors(bpb);
+  if (getFirstDataSector(bpb, sectorsPerFAT) >= totalSectors) {
+    std::cerr << "the FATs and the root directory don't fit in the volume" << std::endl;
+    return false;
+  }
+
+  // every cluster needs an entry in the FAT, and FAT32 only has 28 bits for them
+  const unsigned long long clusters = countClusters(bpb, sectorsPerFAT);
+  const unsigned long long bitsPerEntry = fsType == FAT32 ? 32 : (fsType == FAT16 ? 16 : 12);
+  if ((clusters + 2) * bitsPerEntry > (unsigned long long)sectorsPerFAT * bytesPerSector * 8 || clusters > 0x0FFFFFF5) {
+    std::cerr << "the FAT is too small for the " << clusters << " clusters of the volume" << std::endl;
+    return false;
+  }
+  if (fsType == FAT32 && (rootCluster < 2 || rootCluster >= clusters + 2)) {
+    std::cerr << "invalid root directory cluster: " << rootCluster << std::endl;
+    return false;
+  }
+
+  // only a warning: a partial copy of a drive can still be read up to where it ends
+  if (driveSize != 0 && totalSectors * bytesPerSector > driveSize)
+    std::cerr << "the volume is bigger than the drive (" << totalSectors * bytesPerSector << " > " << driveSize << " bytes)" << std::endl;
+  return true;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,316 @@
+#ifndef DIFF_H
+#define DIFF_H
+
+#include "../extras.h"
+#include "common.h"
+#include "index.h"
+#include "io.h"
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Compares the files of two volumes. The data of every file is hashed in blocks (a cluster, or the smaller
+// of the two cluster sizes), reading only the extents that files use, with several threads at a time.
+// Changes are reported at block granularity from the hashes, so no data is read twice.
+
+const unsigned long long DIFF_CHUNK = 4 << 20; // bytes read at once by a thread
+
+// A volume that was opened only to compare it with the current one
+struct Volume {
+    std::ifstream in;
+    FSType fsType;
+    BPB bpb;
+    EBPB ebpb;
+    EBPB_32 ebpb_32;
+    unsigned int sectorsPerFAT;
+    VolumeIndex index;
+    DataReader reader;
+};
+
+// Opens a volume and indexes it in memory
+bool openVolume(const std::string& path, bool direct, Volume& volume) {
+    volume.in.open(path, std::ios::binary);
+    if (!volume.in) {
+        std::cerr << "could not open " << path << std::endl;
+        return false;
+    }
+
+    volume.in.seekg(0, std::ios::end);
+    const std::streamoff end = volume.in.tellg();
+    volume.in.clear();
+    volume.in.seekg(0);
+
+    if (!readBPB(&volume.bpb, volume.in) || volume.bpb.jmp[0] != 0xEB || volume.bpb.jmp[2] != 0x90) {
+        std::cerr << path << " is not a FAT image" << std::endl;
+        return false;
+    }
+
+    volume.fsType = detectFSType(volume.bpb);
+    if (volume.fsType == FAT32) {
+        fat32::readEBPB(&volume.ebpb_32, volume.in);
+        volume.sectorsPerFAT = volume.ebpb_32.sectorsPerFAT;
+    } else {
+        readEBPB(&volume.ebpb, volume.in);
+        volume.sectorsPerFAT = volume.bpb.sectorsPerFAT;
+    }
+    if (!checkGeometry(volume.fsType, volume.bpb, volume.sectorsPerFAT, volume.fsType == FAT32 ? volume.ebpb_32.rootDirCluster : 0, end > 0 ? end : 0))
+        return false;
+
+    if (!volume.reader.open(path, direct)) {
+        std::cerr << "could not open " << path << std::endl;
+        return false;
+    }
+
+    std::vector<unsigned long long> checksums;
+    checksumFAT(volume.in, volume.bpb, volume.sectorsPerFAT, checksums);
+    const unsigned int volumeId = (volume.fsType == FAT32) ? volume.ebpb_32.volumeId : volume.ebpb.volumeId;
+    volume.index.build(volume.in, volume.fsType, volume.bpb, volume.ebpb_32, volume.sectorsPerFAT, volumeId, checksums);
+    return true;
+}
+
+// One side of the comparison
+struct DiffSide {
+    const VolumeIndex* index;
+    BPB bpb;
+    unsigned int sectorsPerFAT;
+    DataReader* reader;
+};
+
+// The data of one file, and where its block hashes are
+struct DiffFile {
+    unsigned int node;
+    unsigned long long size;
+    size_t firstBlock;
+    size_t blocks;
+};
+
+class VolumeDiff {
+public:
+    // both cluster sizes are powers of two, so the smaller one divides the bigger one and the blocks line up in both volumes
+    VolumeDiff(DiffSide a, DiffSide b, unsigned int threads)
+        : threadCount(threads),
+          blockSize(std::min((unsigned long long)a.bpb.sectorsPerCluster * a.bpb.bytesPerSector,
+                             (unsigned long long)b.bpb.sectorsPerCluster * b.bpb.bytesPerSector)),
+          failed(false) {
+        sides[0] = a;
+        sides[1] = b;
+    }
+
+    void run() {
+        for (int side = 0; side < 2; side++) collectFiles(side);
+        hashAll();
+
+        // files (and directories) by path, sorted so the report is too
+        std::map<std::string, const DiffFile*> paths[2];
+        std::set<std::string> directories[2];
+        for (int side = 0; side < 2; side++) {
+            for (std::map<unsigned int, DiffFile>::const_iterator it = files[side].begin(); it != files[side].end(); ++it)
+                paths[side][sides[side].index->path(it->first)] = &it->second;
+            for (unsigned int i = 1; i < sides[side].index->header().nodeCount; i++)
+                if ((sides[side].index->node(i).attributes & 0x10) && !sides[side].index->isLink(i))
+                    directories[side].insert(sides[side].index->path(i));
+        }
+
+        // files that are only on one side can still be the same file, moved or renamed
+        std::unordered_multimap<unsigned long long, std::string> removedByContent;
+        for (std::map<std::string, const DiffFile*>::iterator it = paths[0].begin(); it != paths[0].end(); ++it)
+            if (!paths[1].count(it->first) && it->second->size > 0) removedByContent.insert(std::make_pair(contentHash(0, *it->second), it->first));
+
+        std::set<std::string> moved;
+        unsigned int added = 0, removed = 0, modified = 0, unchanged = 0, movedCount = 0;
+        for (std::map<std::string, const DiffFile*>::iterator it = paths[1].begin(); it != paths[1].end(); ++it) {
+            if (paths[0].count(it->first) || it->second->size == 0) continue;
+            std::unordered_multimap<unsigned long long, std::string>::iterator match = removedByContent.find(contentHash(1, *it->second));
+            if (match == removedByContent.end()) continue;
+            std::cout << "> " << match->second << " -> " << it->first << " (same content)" << std::endl;
+            moved.insert(match->second);
+            moved.insert(it->first);
+            removedByContent.erase(match);
+            movedCount++;
+        }
+
+        for (std::map<std::string, const DiffFile*>::iterator it = paths[0].begin(); it != paths[0].end(); ++it) {
+            if (paths[1].count(it->first) || moved.count(it->first)) continue;
+            std::cout << "- " << it->first << " (" << it->second->size << " bytes)" << std::endl;
+            removed++;
+        }
+        for (std::map<std::string, const DiffFile*>::iterator it = paths[1].begin(); it != paths[1].end(); ++it) {
+            if (paths[0].count(it->first) || moved.count(it->first)) continue;
+            std::cout << "+ " << it->first << " (" << it->second->size << " bytes)" << std::endl;
+            added++;
+        }
+        for (std::set<std::string>::iterator it = directories[0].begin(); it != directories[0].end(); ++it)
+            if (!directories[1].count(*it)) std::cout << "- " << *it << "/" << std::endl;
+        for (std::set<std::string>::iterator it = directories[1].begin(); it != directories[1].end(); ++it)
+            if (!directories[0].count(*it)) std::cout << "+ " << *it << "/" << std::endl;
+
+        for (std::map<std::string, const DiffFile*>::iterator it = paths[0].begin(); it != paths[0].end(); ++it) {
+            std::map<std::string, const DiffFile*>::iterator other = paths[1].find(it->first);
+            if (other == paths[1].end()) continue;
+            if (compareFiles(it->first, *it->second, *other->second)) unchanged++;
+            else modified++;
+        }
+
+        std::cout << std::endl << std::dec << added << " added, " << removed << " removed, " << modified << " modified, "
+                  << movedCount << " moved, " << unchanged << " unchanged." << std::endl;
+        if (failed) std::cerr << "some data could not be read, so some files may be reported as changed" << std::endl;
+
+        reportDuplicates();
+    }
+
+private:
+    void collectFiles(int side) {
+        const VolumeIndex& index = *sides[side].index;
+        for (unsigned int i = 1; i < index.header().nodeCount; i++) {
+            const IndexNode& node = index.node(i);
+            if ((node.attributes & 0x18) || index.isLink(i)) continue; // directories and volume labels
+
+            DiffFile file = {i, node.size, hashes[side].size(), (node.size + blockSize - 1) / blockSize};
+            hashes[side].resize(hashes[side].size() + file.blocks, 0);
+            files[side][i] = file;
+        }
+    }
+
+    // A range of a file to hash: it is inside one extent, so it is contiguous on the drive
+    struct HashJob {
+        int side;
+        unsigned long long position; // on the drive
+        unsigned long long length;
+        size_t firstBlock;
+    };
+
+    void hashAll() {
+        std::vector<HashJob> jobs;
+        for (int side = 0; side < 2; side++) {
+            const VolumeIndex& index = *sides[side].index;
+            const unsigned long long bytesPerCluster = (unsigned long long)sides[side].bpb.sectorsPerCluster * sides[side].bpb.bytesPerSector;
+
+            for (std::map<unsigned int, DiffFile>::iterator it = files[side].begin(); it != files[side].end(); ++it) {
+                const DiffFile& file = it->second;
+                const IndexNode& node = index.node(file.node);
+                unsigned long long fileOffset = 0;
+
+                // only the part of the extents that holds the file's data is hashed
+                for (unsigned int i = 0; i < node.extentCount && fileOffset < file.size; i++) {
+                    const Extent& extent = index.extents()[node.firstExtent + i];
+                    const unsigned long long start = getClusterAddress(sides[side].bpb, sides[side].sectorsPerFAT, extent.cluster);
+                    const unsigned long long length = std::min<unsigned long long>(extent.count * bytesPerCluster, file.size - fileOffset);
+
+                    for (unsigned long long done = 0; done < length; done += DIFF_CHUNK)
+                        jobs.push_back({side, start + done, std::min(DIFF_CHUNK, length - done), file.firstBlock + (size_t)((fileOffset + done) / blockSize)});
+                    fileOffset += length;
+                }
+                if (fileOffset < file.size) failed = true; // the cluster chain is shorter than the file
+            }
+        }
+
+        BufferPool pool(DIFF_CHUNK + DIRECT_ALIGNMENT, threadCount);
+        std::atomic<size_t> next(0);
+        std::atomic<unsigned long long> hashed(0);
+        std::vector<std::thread> workers;
+        for (unsigned int t = 0; t < threadCount; t++) {
+            workers.push_back(std::thread([&]() {
+                PooledBuffer buffer(pool);
+                for (size_t i = next++; i < jobs.size() && buffer.get(); i = next++) {
+                    const HashJob& job = jobs[i];
+                    const unsigned char* data = sides[job.side].reader->read(job.position, job.length, buffer.get());
+                    if (!data) {
+                        failed = true;
+                        continue;
+                    }
+                    for (unsigned long long offset = 0; offset < job.length; offset += blockSize)
+                        hashes[job.side][job.firstBlock + offset / blockSize] = hashBlock(data + offset, std::min(blockSize, job.length - offset));
+                    hashed += job.length;
+                }
+            }));
+        }
+        for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+
+        std::cout << "Hashed " << computeSizeString(hashed) << " of file data in both volumes, in blocks of " << blockSize
+                  << " bytes with " << threadCount << " threads." << std::endl << std::endl;
+    }
+
+    unsigned long long contentHash(int side, const DiffFile& file) const {
+        const std::vector<unsigned long long>& blocks = hashes[side];
+        return hashBlock((const unsigned char*)(blocks.data() + file.firstBlock), file.blocks * sizeof(unsigned long long),
+                         0xCBF29CE484222325ULL ^ file.size);
+    }
+
+    // Reports the ranges of blocks that differ between the two versions of a file. Returns true if there are none.
+    bool compareFiles(const std::string& path, const DiffFile& a, const DiffFile& b) const {
+        std::vector<std::pair<unsigned long long, unsigned long long>> ranges; // [start, end)
+        const size_t blocks = std::min(a.blocks, b.blocks);
+
+        for (size_t i = 0; i < blocks; i++) {
+            if (hashes[0][a.firstBlock + i] == hashes[1][b.firstBlock + i]) continue;
+            const unsigned long long offset = i * blockSize;
+            addRange(ranges, offset, offset + std::min(blockSize, std::min(a.size, b.size) - offset));
+        }
+        if (a.size != b.size) addRange(ranges, std::min(a.size, b.size), std::max(a.size, b.size));
+
+        if (ranges.empty()) return true;
+
+        std::cout << "~ " << path;
+        if (a.size != b.size) std::cout << " (" << a.size << " -> " << b.size << " bytes)";
+        std::cout << ": ";
+        for (size_t i = 0; i < ranges.size() && i < 10; i++)
+            std::cout << (i > 0 ? ", " : "") << ranges[i].first << "-" << ranges[i].second - 1;
+        if (ranges.size() > 10) std::cout << " and " << ranges.size() - 10 << " more ranges";
+        std::cout << std::endl;
+        return false;
+    }
+
+    static void addRange(std::vector<std::pair<unsigned long long, unsigned long long>>& ranges, unsigned long long start, unsigned long long end) {
+        if (!ranges.empty() && ranges.back().second >= start) ranges.back().second = std::max(ranges.back().second, end);
+        else ranges.push_back(std::make_pair(start, end));
+    }
+
+    // How much of the data is stored more than once, in each volume and across both
+    void reportDuplicates() const {
+        std::vector<unsigned char> zeros(blockSize, 0);
+        const unsigned long long zeroHash = hashBlock(zeros.data(), zeros.size());
+
+        std::unordered_set<unsigned long long> unique[2];
+        unsigned long long zeroBlocks[2] = {0, 0};
+        for (int side = 0; side < 2; side++) {
+            for (size_t i = 0; i < hashes[side].size(); i++) {
+                if (hashes[side][i] == zeroHash) zeroBlocks[side]++;
+                else unique[side].insert(hashes[side][i]);
+            }
+        }
+
+        unsigned long long shared = 0; // blocks of the second volume whose content is also in the first one
+        for (size_t i = 0; i < hashes[1].size(); i++)
+            if (hashes[1][i] != zeroHash && unique[0].count(hashes[1][i])) shared++;
+
+        std::unordered_set<unsigned long long> both(unique[0].begin(), unique[0].end());
+        both.insert(unique[1].begin(), unique[1].end());
+
+        std::cout << std::endl << "**** Duplicate blocks (" << blockSize << " bytes each) ****" << std::endl;
+        for (int side = 0; side < 2; side++) {
+            const unsigned long long duplicates = hashes[side].size() - zeroBlocks[side] - unique[side].size();
+            std::cout << (side == 0 ? "This volume: " : "Other volume: ") << hashes[side].size() << " blocks, "
+                      << duplicates << " duplicates, " << zeroBlocks[side] << " all zeros" << std::endl;
+        }
+        std::cout << "Blocks of the other volume that are also in this one: " << shared << " of " << hashes[1].size()
+                  << " (" << computeSizeString(shared * blockSize) << ")" << std::endl;
+        std::cout << "Distinct blocks in both volumes: " << both.size() << " (" << computeSizeString(both.size() * blockSize)
+                  << " would store both without duplicates)" << std::endl;
+    }
+
+    DiffSide sides[2];
+    unsigned int threadCount;
+    unsigned long long blockSize;
+
+    std::map<unsigned int, DiffFile> files[2]; // node -> file
+    std::vector<unsigned long long> hashes[2]; // block hashes of all the files
+    std::atomic<bool> failed;
+};
+
+#endif
\ No newline at end of file
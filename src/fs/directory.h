@@ -0,0 +1,116 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include "../extras.h"
+#include "cache.h"
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Reads a directory one entry at a time. Only one cluster of the directory is in memory at a time,
+// and the cluster chain is followed only as far as the entries that are asked for.
+// `cluster` is the first cluster of the directory, or -1 for the FAT12/16 root directory.
+class DirectoryIterator {
+public:
+    DirectoryIterator(std::ifstream& in, FSType fsType, BPB bpb, unsigned int sectorsPerFAT, int cluster)
+        : in(in), bpb(bpb), sectorsPerFAT(sectorsPerFAT), fat(in, fsType, bpb, sectorsPerFAT),
+          isRoot(cluster == -1), cluster(cluster), position(0), offset(0), visited(0), started(false), finished(false) {}
+
+    // Gets the next entry. Returns false at the end of the directory.
+    bool next(DirectoryEntry& entry) {
+        while (!finished) {
+            if (offset >= buffer.size() && !load()) break;
+
+            const unsigned char* slot = &buffer[offset];
+            offset += 32;
+
+            if (slot[0] == 0x00) break;  // end of directory
+            if (slot[0] == 0xE5) {       // unused entry
+                longNameEntries.clear();
+                continue;
+            }
+
+            // long filename entry. The parts are stored backwards, right before the 8.3 entry
+            if (slot[11] == 0x0F) {
+                longNameEntries.push_back(parseLongNamePart(slot));
+                continue;
+            }
+
+            parseShortEntry(slot, entry);
+            std::u16string longFilename;
+            for (int i = longNameEntries.size() - 1; i >= 0; i--) longFilename += longNameEntries[i];
+            entry.longFilename = toUTF8(longFilename);
+            longNameEntries.clear();
+            return true;
+        }
+
+        finished = true;
+        return false;
+    }
+
+private:
+    // Reads the next cluster of the directory (or the next part of the root directory) into the buffer
+    bool load() {
+        const unsigned long long bytesPerCluster = (unsigned long long)bpb.sectorsPerCluster * bpb.bytesPerSector;
+        unsigned long long size = bytesPerCluster;
+
+        if (isRoot) {
+            // The root directory on FAT12/16 is immediately after the FATs and has a fixed size
+            const unsigned long long start = (bpb.reservedSectors + (unsigned long long)bpb.FATs * sectorsPerFAT) * bpb.bytesPerSector;
+            const unsigned long long end = start + (unsigned long long)bpb.rootDirectoryEntries * 32;
+            position = started ? position + bytesPerCluster : start;
+            if (position >= end) return false;
+            size = std::min(size, end - position);
+        } else {
+            if (started) {
+                const unsigned int nextCluster = fat.get(cluster);
+                if (fat.isEndOfChain(nextCluster)) return false;
+                if (fat.isBad(nextCluster)) {
+                    std::cerr << "bad cluster while reading directory" << std::endl;
+                    return false;
+                }
+                cluster = nextCluster;
+            }
+            if (cluster < 2 || (unsigned int)cluster >= fat.limit()) {
+                std::cerr << "invalid cluster " << cluster << " in directory" << std::endl;
+                return false;
+            }
+            // a directory can't have more clusters than the volume
+            if (++visited > fat.limit()) {
+                std::cerr << "cluster chain of directory loops at cluster " << cluster << std::endl;
+                return false;
+            }
+            position = getClusterAddress(bpb, sectorsPerFAT, cluster);
+        }
+        started = true;
+
+        buffer.resize(size);
+        in.clear();
+        in.seekg(position);
+        in.read((char*)buffer.data(), size);
+        if (!in) {
+            std::cerr << "could not read directory at offset " << position << std::endl;
+            return false;
+        }
+        offset = 0;
+        return true;
+    }
+
+    std::ifstream& in;
+    BPB bpb;
+    unsigned int sectorsPerFAT;
+    FATCache fat;
+
+    bool isRoot;
+    int cluster;                  // the cluster in the buffer
+    unsigned long long position;  // where the buffer was read from
+    std::vector<unsigned char> buffer;
+    size_t offset;                // of the next slot in the buffer
+    unsigned int visited;
+    bool started;
+    bool finished;
+
+    std::vector<std::u16string> longNameEntries;
+};
+
+#endif
\ No newline at end of file
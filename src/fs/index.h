@@ -0,0 +1,616 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "../extras.h"
+#include "cache.h"
+#include "common.h"
+#include "directory.h"
+#include <cstddef>
+#include <cstdio>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// The sidecar index stores the whole directory tree, the extents of every file and the free space of a volume,
+// so it can be opened without walking the directories again. The file is memory-mapped as is:
+//
+//   IndexHeader | FAT block checksums | IndexNode[nodeCount] | Extent[extentCount] | Extent[freeExtentCount] | names
+//
+// Everything is stored in the byte order of the machine that wrote it.
+
+const char INDEX_MAGIC[8] = {'F', 'A', 'T', 'R', 'I', 'D', 'X', '1'};
+const unsigned int INDEX_VERSION = 3;
+const unsigned int INDEX_FAT_BLOCK = 64 * 1024; // bytes of the FAT covered by each checksum
+const unsigned int NO_NODE = 0xFFFFFFFF;
+
+// The image file at the time the index was checked against it. If the file wasn't changed since,
+// the index can be used without checksumming the FAT again.
+struct ImageStamp {
+    unsigned long long device;
+    unsigned long long inode;
+    unsigned long long size;
+    unsigned long long changeTime; // st_ctim, in nanoseconds
+    unsigned long long checkTime;  // when the image was compared with the index, in nanoseconds
+};
+
+struct IndexHeader {
+    char magic[8];
+    unsigned int version;
+    unsigned int fsType;
+    unsigned int volumeId;
+    unsigned int clusters;
+    unsigned long long FATChecksum; // checksum of the block checksums
+    unsigned int FATBlocks;
+    unsigned int nodeCount;
+    unsigned int extentCount;
+    unsigned int freeExtentCount;
+    unsigned int freeClusters;
+    unsigned int nameBytes;
+    ImageStamp stamp; // all zero if the image isn't a regular file
+};
+
+// A directory entry. The root directory is node 0, and the children of a directory are stored next to each other.
+struct IndexNode {
+    unsigned int parent;
+    unsigned int firstChild;
+    unsigned int childCount;
+    unsigned int firstExtent;
+    unsigned int extentCount;
+    unsigned int nameOffset; // long filename, in the name table
+    unsigned int nameLength;
+    unsigned int firstCluster;
+    unsigned int size;
+    unsigned short creationTime;
+    unsigned short creationDate;
+    unsigned short lastAccessedDate;
+    unsigned short lastModificationTime;
+    unsigned short lastModificationDate;
+    unsigned char filename[11];
+    unsigned char attributes;
+    unsigned char creationTimeHS;
+    unsigned char reserved[5];
+    unsigned long long checksum; // directories only: of their raw contents, see checksumDirectory()
+};
+
+static_assert(sizeof(IndexHeader) == 96, "IndexHeader must not have padding");
+static_assert(sizeof(IndexNode) == 72, "IndexNode must not have padding");
+static_assert(sizeof(Extent) == 8, "Extent must not have padding");
+
+// Hashes 8 bytes at a time, which is much faster than a byte-wise hash for whole blocks of the FAT or of files
+unsigned long long hashBlock(const unsigned char* data, size_t size, unsigned long long seed = 0xCBF29CE484222325ULL) {
+    unsigned long long hash = seed ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        unsigned long long word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    for (; i < size; i++) hash = (hash ^ data[i]) * 0x100000001B3ULL;
+    return hash;
+}
+
+// Checksums the raw contents of a directory: its clusters, or the FAT12/16 root directory if `fixedRoot` is set.
+// Changes like a renamed file or one that grew inside its last cluster don't touch the FAT, only the directory.
+unsigned long long checksumDirectory(std::ifstream& in, BPB bpb, unsigned int sectorsPerFAT, bool fixedRoot,
+                                     const Extent* extents, unsigned int extentCount) {
+    const unsigned long long bytesPerCluster = (unsigned long long)bpb.sectorsPerCluster * bpb.bytesPerSector;
+    std::vector<unsigned char> data;
+
+    in.clear();
+    if (fixedRoot) {
+        data.resize((unsigned long long)bpb.rootDirectoryEntries * 32);
+        in.seekg((bpb.reservedSectors + (unsigned long long)bpb.FATs * sectorsPerFAT) * bpb.bytesPerSector);
+        in.read((char*)data.data(), data.size());
+    } else {
+        for (unsigned int i = 0; i < extentCount; i++) {
+            const size_t start = data.size();
+            data.resize(start + extents[i].count * bytesPerCluster);
+            in.seekg(getClusterAddress(bpb, sectorsPerFAT, extents[i].cluster));
+            in.read((char*)data.data() + start, data.size() - start);
+        }
+    }
+    in.clear();
+    return hashBlock(data.data(), data.size());
+}
+
+class VolumeIndex {
+public:
+    VolumeIndex() : data(nullptr), dataSize(0), mapped(false), reused(0), reusedDirectoryCount(0) {}
+    ~VolumeIndex() { close(); }
+
+    // Maps an index file. Returns false if it doesn't exist or isn't a valid index.
+    bool load(const std::string& path) {
+        close();
+
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat info;
+        if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(IndexHeader)) {
+            ::close(fd);
+            return false;
+        }
+
+        void* address = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (address == MAP_FAILED) return false;
+
+        data = (const unsigned char*)address;
+        dataSize = info.st_size;
+        mapped = true;
+
+        if (!isValid()) {
+            if (memcmp(header().magic, INDEX_MAGIC, 8) == 0 && header().version != INDEX_VERSION)
+                std::cerr << "index " << path << " was made by another version - ignoring it" << std::endl;
+            else
+                std::cerr << "index " << path << " is damaged - ignoring it" << std::endl;
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (mapped) munmap((void*)data, dataSize);
+        owned.clear();
+        data = nullptr;
+        dataSize = 0;
+        mapped = false;
+    }
+
+    bool isLoaded() const { return data != nullptr; }
+
+    // Whether the image file is exactly as it was when the index was last checked against it.
+    // A change in the same instant as the check could have the same timestamp, so the timestamp
+    // is only trusted if it was already a few seconds old then (like "racy" entries in git).
+    bool stampMatches(const ImageStamp& current) const {
+        const ImageStamp& stamp = header().stamp;
+        return isLoaded() && current.changeTime != 0 && stamp.device == current.device && stamp.inode == current.inode &&
+               stamp.size == current.size && stamp.changeTime == current.changeTime &&
+               stamp.changeTime + 2000000000ULL <= stamp.checkTime;
+    }
+
+    // Checks that the index was made from this volume and that neither the FAT nor any directory has changed since.
+    // Every directory is read, but nothing is parsed.
+    bool matches(std::ifstream& in, BPB bpb, unsigned int sectorsPerFAT, unsigned int volumeId,
+                 const std::vector<unsigned long long>& blockChecksums) const {
+        if (!isLoaded() || header().volumeId != volumeId || header().FATBlocks != blockChecksums.size()) return false;
+        if (header().FATChecksum != combineChecksums(blockChecksums)) return false;
+
+        for (unsigned int i = 0; i < header().nodeCount; i++) {
+            const IndexNode& n = node(i);
+            if (i != 0 && (!(n.attributes & 0x10) || isLink(i) || n.firstCluster == 0)) continue;
+            const bool fixedRoot = i == 0 && header().fsType != FAT32;
+            if (checksumDirectory(in, bpb, sectorsPerFAT, fixedRoot, extents() + n.firstExtent, n.extentCount) != n.checksum) return false;
+        }
+        return true;
+    }
+
+    // Walks the whole volume and replaces the current index with a new one.
+    // If an older index of the same volume is loaded, the entries of the directories whose contents haven't changed
+    // are copied from it instead of being parsed again, and so are the extents of the files whose part of the FAT
+    // hasn't changed.
+    void build(std::ifstream& in, FSType fsType, BPB bpb, EBPB_32 ebpb, unsigned int sectorsPerFAT,
+               unsigned int volumeId, const std::vector<unsigned long long>& blockChecksums) {
+        FATCache fat(in, fsType, bpb, sectorsPerFAT);
+
+        // which blocks of the FAT changed since the old index
+        std::vector<bool> changed(blockChecksums.size(), true);
+        const bool incremental = isLoaded() && header().volumeId == volumeId && header().FATBlocks == blockChecksums.size();
+        if (incremental)
+            for (size_t i = 0; i < blockChecksums.size(); i++) changed[i] = this->blockChecksums()[i] != blockChecksums[i];
+
+        std::vector<IndexNode> nodes;
+        std::vector<Extent> extents;
+        std::string names;
+        reused = 0;
+        reusedDirectoryCount = 0;
+
+        IndexNode root = {};
+        root.parent = 0;
+        root.attributes = 0x10;
+        root.firstCluster = (fsType == FAT32) ? ebpb.rootDirCluster : 0;
+        memset(root.filename, ' ', 11);
+        root.firstExtent = 0;
+        if (fsType == FAT32) readExtents(fat, root.firstCluster, extents);
+        root.extentCount = extents.size();
+        nodes.push_back(root);
+
+        // breadth first, so the children of each directory end up next to each other.
+        // The queue holds pairs of (new node, node of the same directory in the old index)
+        std::vector<std::pair<unsigned int, unsigned int>> queue;
+        queue.push_back(std::make_pair(0, incremental ? 0 : NO_NODE));
+
+        // Adds a child to a directory. The extents can be reused if the chain starts at the same cluster
+        // as the old entry's and its part of the FAT is the same.
+        auto addChild = [&](unsigned int directory, IndexNode child, unsigned int oldChild) {
+            const std::string shortName((char*)child.filename, 11);
+            const bool isLink = shortName == ".          " || shortName == "..         ";
+            child.parent = directory;
+            child.firstChild = 0;
+            child.childCount = 0;
+            child.checksum = 0;
+
+            child.firstExtent = extents.size();
+            if (!isLink) {
+                if (oldChild != NO_NODE && chainUnchanged(fsType, oldChild, changed)) {
+                    const Extent* oldExtents = this->extents() + node(oldChild).firstExtent;
+                    extents.insert(extents.end(), oldExtents, oldExtents + node(oldChild).extentCount);
+                    reused++;
+                } else
+                    readExtents(fat, child.firstCluster, extents);
+            }
+            child.extentCount = extents.size() - child.firstExtent;
+
+            nodes.push_back(child);
+            nodes[directory].childCount++;
+
+            if ((child.attributes & 0x10) && !isLink && child.firstCluster != 0)
+                queue.push_back(std::make_pair(nodes.size() - 1, oldChild));
+        };
+
+        for (size_t next = 0; next < queue.size(); next++) {
+            const unsigned int current = queue[next].first;
+            const unsigned int old = queue[next].second;
+            const bool fixedRoot = fsType != FAT32 && current == 0;
+
+            nodes[current].checksum = checksumDirectory(in, bpb, sectorsPerFAT, fixedRoot, extents.data() + nodes[current].firstExtent,
+                                                        nodes[current].extentCount);
+            nodes[current].firstChild = nodes.size();
+            nodes[current].childCount = 0;
+
+            // a directory with the same contents has the same entries, so they don't need to be parsed again
+            if (old != NO_NODE && node(old).checksum == nodes[current].checksum) {
+                for (unsigned int i = 0; i < node(old).childCount; i++) {
+                    const unsigned int oldChild = node(old).firstChild + i;
+                    IndexNode child = node(oldChild);
+                    child.nameOffset = names.size();
+                    names += longName(node(oldChild));
+                    addChild(current, child, oldChild);
+                }
+                reusedDirectoryCount++;
+                continue;
+            }
+
+            // look up the old children by their 8.3 name, which is unique in a directory
+            std::unordered_map<std::string, unsigned int> oldChildren;
+            if (old != NO_NODE)
+                for (unsigned int i = 0; i < node(old).childCount; i++)
+                    oldChildren[std::string((char*)node(node(old).firstChild + i).filename, 11)] = node(old).firstChild + i;
+
+            DirectoryIterator directory(in, fsType, bpb, sectorsPerFAT, fixedRoot ? -1 : (int)nodes[current].firstCluster);
+            DirectoryEntry entry;
+            while (directory.next(entry)) {
+                if ((entry.attributes & 0x08) && !(entry.attributes & 0x10)) continue; // volume label
+
+                IndexNode child = {};
+                child.nameOffset = names.size();
+                child.nameLength = entry.longFilename.size();
+                names += entry.longFilename;
+                child.firstCluster = composeCluster(entry.firstClusterHigh, entry.firstClusterLow);
+                child.size = entry.size;
+                child.creationTime = entry.creationTime;
+                child.creationDate = entry.creationDate;
+                child.lastAccessedDate = entry.lastAccessedDate;
+                child.lastModificationTime = entry.lastModificationTime;
+                child.lastModificationDate = entry.lastModificationDate;
+                memcpy(child.filename, entry.filename, 11);
+                child.attributes = entry.attributes;
+                child.creationTimeHS = entry.creationTimeHS;
+
+                unsigned int oldChild = NO_NODE;
+                std::unordered_map<std::string, unsigned int>::iterator found = oldChildren.find(std::string((char*)entry.filename, 11));
+                if (found != oldChildren.end() && node(found->second).firstCluster == child.firstCluster &&
+                    ((entry.attributes & 0x10) == (node(found->second).attributes & 0x10)))
+                    oldChild = found->second;
+                addChild(current, child, oldChild);
+            }
+        }
+
+        // free space summary
+        std::vector<Extent> freeExtents;
+        const unsigned int freeClusters = findFreeExtents(in, fsType, bpb, sectorsPerFAT, freeExtents);
+
+        IndexHeader newHeader = {};
+        memcpy(newHeader.magic, INDEX_MAGIC, 8);
+        newHeader.version = INDEX_VERSION;
+        newHeader.fsType = fsType;
+        newHeader.volumeId = volumeId;
+        newHeader.clusters = fat.limit() - 2;
+        newHeader.FATChecksum = combineChecksums(blockChecksums);
+        newHeader.FATBlocks = blockChecksums.size();
+        newHeader.nodeCount = nodes.size();
+        newHeader.extentCount = extents.size();
+        newHeader.freeExtentCount = freeExtents.size();
+        newHeader.freeClusters = freeClusters;
+        newHeader.nameBytes = names.size();
+
+        std::vector<unsigned char> buffer;
+        append(buffer, &newHeader, sizeof(newHeader));
+        append(buffer, blockChecksums.data(), blockChecksums.size() * sizeof(unsigned long long));
+        append(buffer, nodes.data(), nodes.size() * sizeof(IndexNode));
+        append(buffer, extents.data(), extents.size() * sizeof(Extent));
+        append(buffer, freeExtents.data(), freeExtents.size() * sizeof(Extent));
+        append(buffer, names.data(), names.size());
+
+        close();
+        owned.swap(buffer);
+        data = owned.data();
+        dataSize = owned.size();
+    }
+
+    // Writes the index next to the old one and then replaces it, so a crash never leaves half an index
+    bool save(const std::string& path) const {
+        const std::string temporary = path + ".tmp";
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        out.write((const char*)data, dataSize);
+        out.close();
+
+        if (!out || std::rename(temporary.c_str(), path.c_str()) != 0) {
+            std::cerr << "could not write index " << path << std::endl;
+            std::remove(temporary.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    const IndexHeader& header() const { return *(const IndexHeader*)data; }
+    const IndexNode& node(unsigned int i) const { return nodes()[i]; }
+    const Extent* extents() const { return (const Extent*)(nodes() + header().nodeCount); }
+    const Extent* freeExtents() const { return extents() + header().extentCount; }
+
+    std::string longName(const IndexNode& node) const {
+        const char* names = (const char*)(freeExtents() + header().freeExtentCount);
+        return std::string(names + node.nameOffset, node.nameLength);
+    }
+
+    DirectoryEntry toEntry(const IndexNode& node) const {
+        DirectoryEntry entry;
+        memcpy(entry.filename, node.filename, 11);
+        entry.filename[11] = '\0';
+        entry.longFilename = longName(node);
+        entry.attributes = node.attributes;
+        entry.creationTimeHS = node.creationTimeHS;
+        entry.creationTime = node.creationTime;
+        entry.creationDate = node.creationDate;
+        entry.lastAccessedDate = node.lastAccessedDate;
+        entry.firstClusterHigh = node.firstCluster >> 16;
+        entry.lastModificationTime = node.lastModificationTime;
+        entry.lastModificationDate = node.lastModificationDate;
+        entry.firstClusterLow = node.firstCluster & 0xFFFF;
+        entry.size = node.size;
+        return entry;
+    }
+
+    // The full path of a node, like "/DIR/Sub Directory/file.txt"
+    std::string path(unsigned int i) const {
+        if (i == 0) return "/";
+
+        std::vector<std::string> parts;
+        for (unsigned int depth = 0; i != 0 && depth < header().nodeCount; depth++) {
+            const DirectoryEntry entry = toEntry(node(i));
+            parts.push_back(entry.longFilename.empty() ? getShortName(entry) : entry.longFilename);
+            i = node(i).parent;
+        }
+
+        std::string result;
+        for (int j = parts.size() - 1; j >= 0; j--) result += "/" + parts[j];
+        return result;
+    }
+
+    // The first directory node that starts at `cluster` (0 is the root directory)
+    unsigned int findDirectory(unsigned int cluster) const {
+        if (cluster == 0 || cluster == node(0).firstCluster) return 0;
+        for (unsigned int i = 1; i < header().nodeCount; i++) {
+            const IndexNode& candidate = node(i);
+            const std::string shortName((char*)candidate.filename, 11);
+            if ((candidate.attributes & 0x10) && candidate.firstCluster == cluster && shortName != ".          " && shortName != "..         ")
+                return i;
+        }
+        return NO_NODE;
+    }
+
+    // The directory that is reached by opening `child`, one of the children of `directory`
+    unsigned int enter(unsigned int directory, unsigned int child) const {
+        const std::string shortName((char*)node(child).filename, 11);
+        if (shortName == ".          ") return directory;
+        if (shortName == "..         ") return node(directory).parent;
+        return child;
+    }
+
+    // Whether the node is the "." or ".." entry of its directory
+    bool isLink(unsigned int i) const {
+        const std::string shortName((char*)node(i).filename, 11);
+        return shortName == ".          " || shortName == "..         ";
+    }
+
+    // The node at `path` (like "/DIR/file.txt"), or NO_NODE if there is none.
+    // Names are matched like the names typed in the shell.
+    unsigned int find(const std::string& path) const {
+        unsigned int current = 0;
+        size_t start = 0;
+        while (start <= path.size()) {
+            size_t end = path.find('/', start);
+            if (end == std::string::npos) end = path.size();
+            const std::string part = path.substr(start, end - start);
+            start = end + 1;
+
+            if (part.empty() || part == ".") continue;
+            if (!(node(current).attributes & 0x10)) return NO_NODE;
+            if (part == "..") {
+                current = node(current).parent;
+                continue;
+            }
+
+            unsigned int next = NO_NODE;
+            for (unsigned int i = 0; i < node(current).childCount && next == NO_NODE; i++) {
+                const unsigned int child = node(current).firstChild + i;
+                if (!isLink(child) && matchesName(toEntry(node(child)), part)) next = child;
+            }
+            if (next == NO_NODE) return NO_NODE;
+            current = next;
+        }
+        return current;
+    }
+
+    // How many extent lists were copied from the old index by the last build()
+    unsigned int reusedExtents() const { return reused; }
+    // How many directories weren't parsed again by the last build(), because they hadn't changed
+    unsigned int reusedDirectories() const { return reusedDirectoryCount; }
+
+private:
+    const unsigned long long* blockChecksums() const { return (const unsigned long long*)(data + sizeof(IndexHeader)); }
+    const IndexNode* nodes() const { return (const IndexNode*)(blockChecksums() + header().FATBlocks); }
+
+    // Makes sure that all the tables fit in the file and that the tree doesn't point outside of them
+    bool isValid() const {
+        const IndexHeader& h = header();
+        if (memcmp(h.magic, INDEX_MAGIC, 8) != 0 || h.version != INDEX_VERSION || h.nodeCount == 0) return false;
+
+        const unsigned long long expected = sizeof(IndexHeader) + (unsigned long long)h.FATBlocks * sizeof(unsigned long long) +
+                                            (unsigned long long)h.nodeCount * sizeof(IndexNode) +
+                                            ((unsigned long long)h.extentCount + h.freeExtentCount) * sizeof(Extent) + h.nameBytes;
+        if (expected != dataSize) return false;
+
+        for (unsigned int i = 0; i < h.nodeCount; i++) {
+            const IndexNode& n = node(i);
+            if (n.parent >= h.nodeCount || (unsigned long long)n.firstChild + n.childCount > h.nodeCount ||
+                (unsigned long long)n.firstExtent + n.extentCount > h.extentCount ||
+                (unsigned long long)n.nameOffset + n.nameLength > h.nameBytes)
+                return false;
+        }
+        return true;
+    }
+
+    // Checks whether every FAT entry of the old node's chain is in a block that didn't change
+    bool chainUnchanged(FSType fsType, unsigned int oldNode, const std::vector<bool>& changed) const {
+        const IndexNode& n = node(oldNode);
+        if (n.extentCount == 0) return n.firstCluster == 0;
+
+        for (unsigned int i = 0; i < n.extentCount; i++) {
+            const Extent& extent = extents()[n.firstExtent + i];
+            const unsigned long long first = FATOffset(fsType, extent.cluster);
+            const unsigned long long last = FATOffset(fsType, extent.cluster + extent.count - 1) + 3;
+
+            for (unsigned long long block = first / INDEX_FAT_BLOCK; block <= last / INDEX_FAT_BLOCK; block++)
+                if (block >= changed.size() || changed[block]) return false;
+        }
+        return true;
+    }
+
+    static unsigned long long FATOffset(FSType fsType, unsigned int cluster) {
+        if (fsType == FAT32) return (unsigned long long)cluster * 4;
+        if (fsType == FAT16) return (unsigned long long)cluster * 2;
+        return cluster + cluster / 2;
+    }
+
+    static unsigned long long combineChecksums(const std::vector<unsigned long long>& blockChecksums) {
+        return hashBlock((const unsigned char*)blockChecksums.data(), blockChecksums.size() * sizeof(unsigned long long));
+    }
+
+    static void append(std::vector<unsigned char>& buffer, const void* bytes, size_t size) {
+        buffer.insert(buffer.end(), (const unsigned char*)bytes, (const unsigned char*)bytes + size);
+    }
+
+    const unsigned char* data;
+    size_t dataSize;
+    bool mapped;
+    std::vector<unsigned char> owned; // the data of an index that was just built
+    unsigned int reused;
+    unsigned int reusedDirectoryCount;
+};
+
+// Records when the image was checked and what it looked like then. Returns false if it isn't a regular file,
+// whose timestamps can't be relied on to change when it is written to (like a block device).
+bool stampImage(const std::string& imagePath, ImageStamp& stamp) {
+    stamp = ImageStamp();
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    struct stat info;
+    if (stat(imagePath.c_str(), &info) != 0 || !S_ISREG(info.st_mode)) return false;
+    stamp.device = info.st_dev;
+    stamp.inode = info.st_ino;
+    stamp.size = info.st_size;
+    stamp.changeTime = info.st_ctim.tv_sec * 1000000000ULL + info.st_ctim.tv_nsec;
+    stamp.checkTime = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    return true;
+}
+
+// Replaces the stamp in the header of a saved index
+bool saveStamp(const std::string& path, const ImageStamp& stamp) {
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+    file.seekp(offsetof(IndexHeader, stamp));
+    file.write((const char*)&stamp, sizeof(stamp));
+    return (bool)file;
+}
+
+// Checksums the first FAT in blocks of INDEX_FAT_BLOCK bytes
+void checksumFAT(std::ifstream& in, BPB bpb, unsigned int sectorsPerFAT, std::vector<unsigned long long>& checksums) {
+    const unsigned long long FATSize = (unsigned long long)sectorsPerFAT * bpb.bytesPerSector;
+    std::vector<unsigned char> block(INDEX_FAT_BLOCK);
+
+    in.clear();
+    in.seekg((unsigned long long)bpb.reservedSectors * bpb.bytesPerSector);
+    for (unsigned long long position = 0; position < FATSize; position += INDEX_FAT_BLOCK) {
+        const size_t size = std::min<unsigned long long>(INDEX_FAT_BLOCK, FATSize - position);
+        in.read((char*)block.data(), size);
+        checksums.push_back(hashBlock(block.data(), size));
+    }
+}
+
+// Loads the index at `path` if it is up to date, or else (re)builds it and saves it.
+// If the image file wasn't changed since the index was last checked, the volume isn't even read.
+// `changed` says that the volume was just written to, so the index (already loaded) is updated without checking it first.
+void openIndex(VolumeIndex& index, const std::string& path, const std::string& imagePath, std::ifstream& in, FSType fsType,
+               BPB bpb, EBPB_32 ebpb, unsigned int sectorsPerFAT, unsigned int volumeId, bool changed = false) {
+    ImageStamp stamp;
+    const bool stamped = stampImage(imagePath, stamp);
+    if (!changed && index.load(path) && index.header().volumeId == volumeId && stamped && index.stampMatches(stamp)) {
+        std::cout << "Index loaded (" << index.header().nodeCount << " entries)." << std::endl;
+        return;
+    }
+
+    std::vector<unsigned long long> checksums;
+    checksumFAT(in, bpb, sectorsPerFAT, checksums);
+
+    if (!changed && index.matches(in, bpb, sectorsPerFAT, volumeId, checksums)) {
+        if (stamped) saveStamp(path, stamp);
+        std::cout << "Index loaded (" << index.header().nodeCount << " entries)." << std::endl;
+        return;
+    }
+
+    const bool incremental = index.isLoaded() && index.header().volumeId == volumeId;
+    std::cout << (!incremental ? "Building index..." : changed ? "Updating index..." : "Index is out of date, updating it...") << std::endl;
+    index.build(in, fsType, bpb, ebpb, sectorsPerFAT, volumeId, checksums);
+    if (incremental)
+        std::cout << "Reused " << index.reusedDirectories() << " unchanged directories and the extents of " << index.reusedExtents()
+                  << " entries." << std::endl;
+
+    if (index.save(path)) {
+        if (stamped) saveStamp(path, stamp);
+        index.load(path);
+    }
+    std::cout << "Index saved (" << index.header().nodeCount << " entries)." << std::endl;
+}
+
+void printIndexInfo(const VolumeIndex& index) {
+    const IndexHeader& header = index.header();
+    std::cout << std::dec << "Entries: " << header.nodeCount << std::endl;
+    std::cout << "File extents: " << header.extentCount << std::endl;
+    std::cout << "Free clusters: " << header.freeClusters << " of " << header.clusters << std::endl;
+    std::cout << "Free extents: " << header.freeExtentCount << std::endl;
+
+    unsigned int largest = 0;
+    for (unsigned int i = 0; i < header.freeExtentCount; i++) largest = std::max(largest, index.freeExtents()[i].count);
+    std::cout << "Largest free extent: " << largest << " clusters" << std::endl;
+}
+
+#endif
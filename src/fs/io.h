@@ -0,0 +1,155 @@
+#ifndef IO_H
+#define IO_H
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// O_DIRECT needs the offset, the size and the address of every read to be aligned to the logical block size.
+// 4096 works for both 512-byte and 4K sector devices.
+const size_t DIRECT_ALIGNMENT = 4096;
+
+// A fixed set of equally sized, aligned buffers that are reused for every read,
+// so reading a file never needs more memory than the pool was created with. It can be shared between threads.
+class BufferPool {
+public:
+    BufferPool(size_t bufferSize, unsigned int count) : size(roundUp(bufferSize)) {
+        for (unsigned int i = 0; i < count; i++) {
+            void* buffer;
+            if (posix_memalign(&buffer, DIRECT_ALIGNMENT, size) != 0) {
+                std::cerr << "could not allocate a buffer" << std::endl;
+                continue;
+            }
+            all.push_back((unsigned char*)buffer);
+            available.push_back((unsigned char*)buffer);
+        }
+    }
+
+    ~BufferPool() {
+        for (size_t i = 0; i < all.size(); i++) free(all[i]);
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Returns nullptr if every buffer is in use
+    unsigned char* acquire() {
+        std::lock_guard<std::mutex> guard(lock);
+        if (available.empty()) return nullptr;
+        unsigned char* buffer = available.back();
+        available.pop_back();
+        return buffer;
+    }
+
+    void release(unsigned char* buffer) {
+        if (!buffer) return;
+        std::lock_guard<std::mutex> guard(lock);
+        available.push_back(buffer);
+    }
+
+    size_t bufferSize() const { return size; }
+
+    // The most that can be read into one buffer with DataReader::read()
+    size_t maxRead() const { return size - DIRECT_ALIGNMENT; }
+
+    static size_t roundUp(size_t value) { return (value + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT; }
+
+private:
+    size_t size;
+    std::vector<unsigned char*> all;
+    std::vector<unsigned char*> available;
+    std::mutex lock;
+};
+
+// Gives a buffer back to the pool when it goes out of scope
+class PooledBuffer {
+public:
+    explicit PooledBuffer(BufferPool& pool) : pool(pool), buffer(pool.acquire()) {}
+    ~PooledBuffer() { pool.release(buffer); }
+
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    unsigned char* get() const { return buffer; }
+
+private:
+    BufferPool& pool;
+    unsigned char* buffer;
+};
+
+// Reads file data from the drive with pread(). In direct mode the drive is opened with O_DIRECT,
+// so the data doesn't go through (and doesn't evict anything from) the page cache.
+class DataReader {
+public:
+    DataReader() : fd(-1), direct(false), dropCache(false) {}
+    ~DataReader() { close(); }
+
+    DataReader(const DataReader&) = delete;
+    DataReader& operator=(const DataReader&) = delete;
+
+    bool open(const std::string& path, bool useDirect) {
+        close();
+        direct = false;
+        dropCache = false;
+
+        if (useDirect) {
+            fd = ::open(path.c_str(), O_RDONLY | O_DIRECT);
+            if (fd >= 0) {
+                direct = true;
+                return true;
+            }
+            // some filesystems (like tmpfs) don't support O_DIRECT
+            std::cerr << "could not open drive with O_DIRECT (" << strerror(errno)
+                      << "), dropping data from the page cache after reading instead" << std::endl;
+        }
+
+        fd = ::open(path.c_str(), O_RDONLY);
+        dropCache = useDirect;
+        return fd >= 0;
+    }
+
+    void close() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+    }
+
+    bool isDirect() const { return direct; }
+
+    // Reads `size` bytes at `offset` into the buffer and returns a pointer to them. Safe to call from several threads.
+    // The buffer must be at least BufferPool::roundUp(size) + DIRECT_ALIGNMENT bytes, because in direct mode
+    // the read is widened to aligned boundaries and the data starts somewhere inside the buffer.
+    // Returns nullptr on failure.
+    const unsigned char* read(unsigned long long offset, size_t size, unsigned char* buffer) {
+        const unsigned long long start = direct ? offset / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT : offset;
+        const size_t length = direct ? BufferPool::roundUp(offset + size - start) : size;
+
+        size_t done = 0;
+        while (done < length) {
+            ssize_t result = pread(fd, buffer + done, length - done, start + done);
+            if (result < 0 && errno == EINTR) continue;
+            if (result <= 0) break; // error or the end of the drive
+            done += result;
+        }
+
+        if (done < offset - start + size) {
+            std::cerr << "could not read " << size << " bytes at offset " << offset << std::endl;
+            return nullptr;
+        }
+
+        if (dropCache) posix_fadvise(fd, start, length, POSIX_FADV_DONTNEED);
+        return buffer + (offset - start);
+    }
+
+private:
+    int fd;
+    bool direct;
+    bool dropCache;
+};
+
+#endif
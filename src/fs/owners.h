@@ -0,0 +1,153 @@
+#ifndef OWNERS_H
+#define OWNERS_H
+
+#include "../extras.h"
+#include "cache.h"
+#include "index.h"
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// A run of clusters and the file (or directory) it belongs to
+struct OwnedExtent {
+    unsigned int cluster;
+    unsigned int count;
+    unsigned int node;     // in the index
+    unsigned int position; // number of clusters of the file before this extent
+};
+
+// Maps clusters back to the files that own them. The extents are kept sorted by their first cluster,
+// so every lookup is a binary search.
+class OwnerMap {
+public:
+    OwnerMap() : built(false) {}
+
+    void build(const VolumeIndex& index) {
+        extents.clear();
+        for (unsigned int i = 0; i < index.header().nodeCount; i++) {
+            const IndexNode& node = index.node(i);
+            unsigned int position = 0;
+            for (unsigned int j = 0; j < node.extentCount; j++) {
+                const Extent& extent = index.extents()[node.firstExtent + j];
+                extents.push_back({extent.cluster, extent.count, i, position});
+                position += extent.count;
+            }
+        }
+
+        std::sort(extents.begin(), extents.end(),
+                  [](const OwnedExtent& a, const OwnedExtent& b) { return a.cluster < b.cluster; });
+        built = true;
+    }
+
+    void clear() {
+        extents.clear();
+        built = false;
+    }
+
+    bool isBuilt() const { return built; }
+    size_t size() const { return extents.size(); }
+
+    // The extent that contains the cluster, or nullptr if no file owns it
+    const OwnedExtent* find(unsigned int cluster) const {
+        std::vector<OwnedExtent>::const_iterator it = std::upper_bound(extents.begin(), extents.end(), cluster,
+            [](unsigned int value, const OwnedExtent& extent) { return value < extent.cluster; });
+        if (it == extents.begin()) return nullptr;
+        --it;
+        if (cluster - it->cluster >= it->count) return nullptr;
+        return &*it;
+    }
+
+private:
+    std::vector<OwnedExtent> extents;
+    bool built;
+};
+
+// Parses "sector <n>", "cluster <n>" or "byte <n>" (decimal or 0x hex) into a byte offset in the volume.
+// A number on its own is taken as a sector. Sectors are counted like the kernel counts them in I/O errors:
+// in 512-byte units from the start of the whole disk, whatever the sector size of the volume is.
+// The volume starts `hiddenSectors` (logical) sectors into the disk. A byte is an offset in the volume.
+bool parseLocation(const std::string& query, BPB bpb, unsigned int sectorsPerFAT, unsigned long long& offset) {
+    std::istringstream stream(query);
+    std::string first, second;
+    stream >> first >> second;
+
+    std::string unit = second.empty() ? "sector" : first;
+    const std::string& number = second.empty() ? first : second;
+    if (number.empty()) return false;
+
+    char* end;
+    errno = 0;
+    const unsigned long long value = strtoull(number.c_str(), &end, 0);
+    if (*end != '\0' || errno != 0) return false;
+
+    if (unit == "sector") {
+        const unsigned long long volumeStart = (unsigned long long)bpb.hiddenSectors * bpb.bytesPerSector;
+        if (value > 0xFFFFFFFFFFFFFFFFULL / 512) return false;
+        if (value * 512 < volumeStart) {
+            std::cerr << "sector " << value << " is before the start of the volume (sector " << volumeStart / 512 << ")" << std::endl;
+            return false;
+        }
+        offset = value * 512 - volumeStart;
+    } else if (unit == "byte" || unit == "offset") offset = value;
+    else if (unit == "cluster") {
+        if (value < 2 || value > 0xFFFFFFFF) return false;
+        offset = getClusterAddress(bpb, sectorsPerFAT, value);
+    } else
+        return false;
+    return true;
+}
+
+// Says what is stored at a byte offset of the volume: a file (and where in it), a directory or a structure of the filesystem
+std::string describeLocation(unsigned long long offset, FSType fsType, BPB bpb, unsigned int sectorsPerFAT,
+                             const OwnerMap& owners, const VolumeIndex& index, FATCache& fat) {
+    const unsigned long long bytesPerSector = bpb.bytesPerSector;
+    const unsigned long long bytesPerCluster = bpb.sectorsPerCluster * bytesPerSector;
+    const unsigned long long FATStart = bpb.reservedSectors * bytesPerSector;
+    const unsigned long long FATSize = (unsigned long long)sectorsPerFAT * bytesPerSector;
+    const unsigned long long rootStart = FATStart + bpb.FATs * FATSize;
+    const unsigned long long dataStart = rootStart + ((bpb.rootDirectoryEntries * 32 + bytesPerSector - 1) / bytesPerSector) * bytesPerSector;
+
+    std::ostringstream result;
+    if (offset < FATStart) {
+        result << (offset < bytesPerSector ? "boot sector" : "reserved sectors");
+        return result.str();
+    }
+    if (offset < rootStart) {
+        const unsigned int bitsPerEntry = fsType == FAT32 ? 32 : (fsType == FAT16 ? 16 : 12);
+        result << "FAT #" << (offset - FATStart) / FATSize + 1 << ", entry of cluster " << ((offset - FATStart) % FATSize) * 8 / bitsPerEntry;
+        return result.str();
+    }
+    if (offset < dataStart) {
+        result << "root directory (entry " << (offset - rootStart) / 32 << ")";
+        return result.str();
+    }
+
+    const unsigned long long cluster = (offset - dataStart) / bytesPerCluster + 2;
+    if (cluster >= fat.limit()) {
+        result << "beyond the last cluster of the volume";
+        return result.str();
+    }
+
+    result << "cluster " << cluster << ": ";
+    const OwnedExtent* owner = owners.find(cluster);
+    if (owner) {
+        const IndexNode& node = index.node(owner->node);
+        const unsigned long long fileOffset = (owner->position + (cluster - owner->cluster)) * bytesPerCluster + (offset - dataStart) % bytesPerCluster;
+        result << index.path(owner->node);
+        if (node.attributes & 0x10) result << " (directory)";
+        else if (fileOffset >= node.size) result << " (slack after the end of the file)";
+        else result << " (byte " << fileOffset << " of " << node.size << ")";
+        return result.str();
+    }
+
+    const unsigned int value = fat.get(cluster);
+    if (value == 0) result << "free";
+    else if (fat.isBad(value)) result << "marked as bad";
+    else result << "allocated, but not part of any file (lost cluster)";
+    return result.str();
+}
+
+#endif
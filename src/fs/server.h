@@ -0,0 +1,528 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "../extras.h"
+#include "index.h"
+#include "io.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <deque>
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Server mode: the volume is opened once and its files are served over a Unix domain socket.
+//
+// A client sends a RequestHeader followed by `pathLength` bytes of path ("/DIR/file.txt"),
+// and gets back a ResponseHeader followed by `length` bytes:
+//   LIST - `count` EntryInfo records, each followed by `nameLength` bytes of name
+//   STAT - one EntryInfo record and the name
+//   READ - up to `length` bytes of the file, starting at `offset`
+// Any number of requests can be sent on the same connection, one after the other.
+// Everything is in the byte order of the machine, since both ends are on it.
+
+enum RequestType { REQUEST_LIST = 1, REQUEST_STAT = 2, REQUEST_READ = 3 };
+
+enum ResponseStatus {
+    STATUS_OK = 0,
+    STATUS_NOT_FOUND = 1,
+    STATUS_NOT_A_DIRECTORY = 2,
+    STATUS_IS_A_DIRECTORY = 3,
+    STATUS_BAD_REQUEST = 4,
+    STATUS_IO_ERROR = 5
+};
+
+struct RequestHeader {
+    unsigned int type;
+    unsigned int pathLength;
+    unsigned long long offset; // READ only
+    unsigned long long length; // READ only
+};
+
+struct ResponseHeader {
+    unsigned int status;
+    unsigned int count;
+    unsigned long long length; // bytes that follow the header
+};
+
+struct EntryInfo {
+    unsigned long long size;
+    unsigned int firstCluster;
+    unsigned short creationTime;
+    unsigned short creationDate;
+    unsigned short lastAccessedDate;
+    unsigned short lastModificationTime;
+    unsigned short lastModificationDate;
+    unsigned char attributes;
+    unsigned char reserved[5];
+    unsigned int nameLength;
+};
+
+static_assert(sizeof(RequestHeader) == 24, "RequestHeader must not have padding");
+static_assert(sizeof(ResponseHeader) == 16, "ResponseHeader must not have padding");
+static_assert(sizeof(EntryInfo) == 32, "EntryInfo must not have padding");
+
+const unsigned int MAX_REQUEST_PATH = 4096;
+
+volatile sig_atomic_t serverStopping = 0;
+void stopServer(int) { serverStopping = 1; }
+
+const unsigned long long SERVER_TURN_BYTES = 8 << 20; // sent to one client before the others get a turn
+const std::chrono::milliseconds ACCEPT_RETRY_DELAY(200); // how long new connections wait when no descriptor is left
+
+// One client. Only the thread that got its event works on it.
+struct Connection {
+    int fd;
+
+    // the request being received
+    RequestHeader request;
+    std::string path;
+    size_t received; // bytes of the header and the path so far
+
+    // the reply being sent: `pending` first, then `fileRemaining` bytes of `file` from `fileOffset`
+    bool replying;
+    bool closeAfterReply;
+    std::vector<unsigned char> pending;
+    size_t pendingSent;
+    const IndexNode* file;
+    unsigned long long fileOffset;
+    unsigned long long fileRemaining;
+    unsigned int extent;            // the extent that holds fileOffset
+    unsigned long long extentStart; // position of that extent in the file
+};
+
+// Waits for requests with epoll and hands every connection that can make progress to a pool of worker threads.
+// The client sockets are non-blocking: a worker receives as much of a request and sends as much of a reply as the
+// socket takes right away, and then the connection is watched again (EPOLLONESHOT) for EPOLLIN or EPOLLOUT.
+// So a client that doesn't read its replies doesn't hold a thread, and no two threads ever work on the same client.
+// The index is never modified, so the threads share it without locks.
+class VolumeServer {
+public:
+    VolumeServer(const VolumeIndex& index, BPB bpb, unsigned int sectorsPerFAT, DataReader& reader,
+                 const std::string& drive, unsigned int threads)
+        : index(index), bpb(bpb), sectorsPerFAT(sectorsPerFAT), reader(reader), threadCount(threads),
+          pool(std::max<size_t>(bpb.sectorsPerCluster * bpb.bytesPerSector, 1 << 20) + DIRECT_ALIGNMENT, threads),
+          epollFd(-1), acceptFailing(false), stopping(false), zeroCopy(!reader.isDirect()) {
+        // sendfile() goes through the page cache, so in direct mode the data is copied through the buffers instead
+        driveFd = ::open(drive.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+
+    ~VolumeServer() {
+        if (driveFd >= 0) ::close(driveFd);
+    }
+
+    VolumeServer(const VolumeServer&) = delete;
+    VolumeServer& operator=(const VolumeServer&) = delete;
+
+    // Serves requests until SIGINT or SIGTERM
+    bool run(const std::string& socketPath) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path)) {
+            std::cerr << "socket path is too long" << std::endl;
+            return false;
+        }
+        strcpy(address.sun_path, socketPath.c_str());
+
+        // a socket can be left behind by a server that didn't exit cleanly, but anything else at the path is kept
+        struct stat existing;
+        if (lstat(socketPath.c_str(), &existing) == 0) {
+            if (!S_ISSOCK(existing.st_mode)) {
+                std::cerr << socketPath << " already exists and is not a socket" << std::endl;
+                return false;
+            }
+            unlink(socketPath.c_str());
+        }
+
+        const int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0 || bind(listenFd, (sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, SOMAXCONN) != 0) {
+            std::cerr << "could not listen on " << socketPath << ": " << strerror(errno) << std::endl;
+            if (listenFd >= 0) ::close(listenFd);
+            return false;
+        }
+
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        epoll_event listenEvent = {};
+        listenEvent.events = EPOLLIN;
+        listenEvent.data.ptr = nullptr; // the listening socket
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent);
+
+        // a client that goes away in the middle of a reply must not kill the server
+        signal(SIGPIPE, SIG_IGN);
+        struct sigaction action = {};
+        action.sa_handler = stopServer;
+        sigaction(SIGINT, &action, nullptr); // no SA_RESTART, so epoll_pwait() returns
+        sigaction(SIGTERM, &action, nullptr);
+
+        // The signals stay blocked, except while this thread waits in epoll_pwait(): one that comes between the
+        // check of serverStopping and the wait is delivered when the wait starts, so it can't be missed.
+        // The workers never get them.
+        sigset_t signals, previous, waitMask;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, &previous);
+        waitMask = previous;
+        sigdelset(&waitMask, SIGINT);
+        sigdelset(&waitMask, SIGTERM);
+        std::vector<std::thread> workers;
+        for (unsigned int i = 0; i < threadCount; i++) workers.push_back(std::thread(&VolumeServer::work, this));
+
+        std::cout << "Serving " << index.header().nodeCount << " entries on " << socketPath << " with "
+                  << threadCount << " threads" << (zeroCopy ? "" : " (without sendfile)") << "." << std::endl;
+
+        // while the listening socket is out of the epoll set, the wait only lasts until it is put back
+        bool listening = true;
+        std::chrono::steady_clock::time_point resumeListening;
+
+        epoll_event events[64];
+        while (!serverStopping) {
+            int timeout = -1;
+            if (!listening) {
+                const std::chrono::milliseconds left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    resumeListening - std::chrono::steady_clock::now());
+                timeout = std::max<long long>(left.count(), 0);
+            }
+
+            const int count = epoll_pwait(epollFd, events, 64, timeout, &waitMask);
+            if (count < 0) {
+                if (errno == EINTR) continue;
+                std::cerr << "epoll_wait failed: " << strerror(errno) << std::endl;
+                break;
+            }
+
+            if (!listening && std::chrono::steady_clock::now() >= resumeListening) {
+                epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &listenEvent);
+                listening = true;
+            }
+
+            for (int i = 0; i < count; i++) {
+                if (!events[i].data.ptr) {
+                    // the socket stays readable while connections wait, so it is left out for a while instead
+                    if (!accept(listenFd)) {
+                        epoll_ctl(epollFd, EPOLL_CTL_DEL, listenFd, nullptr);
+                        listening = false;
+                        resumeListening = std::chrono::steady_clock::now() + ACCEPT_RETRY_DELAY;
+                    }
+                } else {
+                    std::lock_guard<std::mutex> guard(lock);
+                    ready.push_back((Connection*)events[i].data.ptr);
+                    wakeUp.notify_one();
+                }
+            }
+        }
+
+        // a worker never waits for a client, so this only takes as long as the turns that are running
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            wakeUp.notify_all();
+        }
+        for (size_t i = 0; i < workers.size(); i++) workers[i].join();
+
+        for (std::map<int, std::unique_ptr<Connection>>::iterator it = connections.begin(); it != connections.end(); ++it)
+            ::close(it->first);
+        connections.clear();
+        ::close(epollFd);
+        ::close(listenFd);
+        unlink(socketPath.c_str());
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+        std::cout << "Server stopped." << std::endl;
+        return true;
+    }
+
+private:
+    // Accepts all the waiting connections. Returns false if they can't be accepted for now, for example
+    // because the process has no file descriptors left (EMFILE) until some clients disconnect.
+    bool accept(int listenFd) {
+        while (true) {
+            const int client = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return true; // no more waiting connections
+                if (errno == EINTR || errno == ECONNABORTED) continue;   // the client went away while waiting
+                if (!acceptFailing) std::cerr << "could not accept a connection: " << strerror(errno) << std::endl;
+                acceptFailing = true; // said once until a connection is accepted again
+                return false;
+            }
+            acceptFailing = false;
+
+            Connection* connection = new Connection();
+            connection->fd = client;
+            connection->received = 0;
+            connection->replying = false;
+            connection->closeAfterReply = false;
+            connection->pendingSent = 0;
+            connection->file = nullptr;
+            connection->fileRemaining = 0;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                connections[client].reset(connection);
+            }
+            epoll_event event = {};
+            event.events = EPOLLIN | EPOLLONESHOT;
+            event.data.ptr = connection;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, client, &event);
+        }
+    }
+
+    void work() {
+        while (true) {
+            Connection* connection;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wakeUp.wait(guard, [this] { return stopping || !ready.empty(); });
+                if (stopping) return;
+                connection = ready.front();
+                ready.pop_front();
+            }
+
+            const unsigned int next = serve(*connection);
+            if (next != 0) {
+                epoll_event event = {};
+                event.events = next | EPOLLONESHOT;
+                event.data.ptr = connection;
+                epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->fd, &event);
+            } else {
+                epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->fd, nullptr);
+                const int fd = connection->fd;
+                std::lock_guard<std::mutex> guard(lock);
+                connections.erase(fd); // deletes the connection
+                ::close(fd);
+            }
+        }
+    }
+
+    // Moves the connection along as far as it can go without waiting, sending at most SERVER_TURN_BYTES.
+    // Returns the event to wait for next (EPOLLIN or EPOLLOUT), or 0 if the connection should be closed.
+    unsigned int serve(Connection& connection) {
+        unsigned long long budget = SERVER_TURN_BYTES;
+        while (true) {
+            if (connection.replying) {
+                const int result = sendReply(connection, budget);
+                if (result < 0) return 0;
+                if (result == 0) return EPOLLOUT; // the socket is full, or the turn is over
+                connection.replying = false;
+                if (connection.closeAfterReply) return 0;
+                if (budget == 0) return EPOLLIN; // the next request waits for the next turn
+            }
+
+            const int result = receiveRequest(connection);
+            if (result < 0) return 0;
+            if (result == 0) return EPOLLIN;
+            handleRequest(connection);
+        }
+    }
+
+    // Receives what the socket has of the current request.
+    // Returns 1 when the whole request is there, 0 if more is needed and -1 if the connection was closed.
+    int receiveRequest(Connection& connection) {
+        while (true) {
+            unsigned char* target;
+            size_t wanted;
+            if (connection.received < sizeof(RequestHeader)) {
+                target = (unsigned char*)&connection.request + connection.received;
+                wanted = sizeof(RequestHeader) - connection.received;
+            } else {
+                const size_t pathReceived = connection.received - sizeof(RequestHeader);
+                if (pathReceived == connection.path.size()) return 1;
+                target = (unsigned char*)&connection.path[pathReceived];
+                wanted = connection.path.size() - pathReceived;
+            }
+
+            const ssize_t received = recv(connection.fd, target, wanted, 0);
+            if (received < 0 && errno == EINTR) continue;
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+            if (received <= 0) return -1;
+            connection.received += received;
+
+            if (connection.received == sizeof(RequestHeader)) {
+                if (connection.request.pathLength > MAX_REQUEST_PATH) return 1; // answered with an error
+                connection.path.assign(connection.request.pathLength, '\0');
+            }
+        }
+    }
+
+    // Sets up the reply to the request that was just received
+    void handleRequest(Connection& connection) {
+        const RequestHeader request = connection.request;
+        connection.received = 0;
+
+        if (request.pathLength > MAX_REQUEST_PATH ||
+            (request.type != REQUEST_LIST && request.type != REQUEST_STAT && request.type != REQUEST_READ)) {
+            reply(connection, STATUS_BAD_REQUEST);
+            connection.closeAfterReply = true;
+            return;
+        }
+
+        const unsigned int node = index.find(connection.path);
+        if (node == NO_NODE) return reply(connection, STATUS_NOT_FOUND);
+
+        const bool isDirectory = (index.node(node).attributes & 0x10) != 0;
+        if (request.type == REQUEST_LIST) {
+            if (!isDirectory) return reply(connection, STATUS_NOT_A_DIRECTORY);
+
+            std::vector<unsigned char> payload;
+            unsigned int count = 0;
+            for (unsigned int i = 0; i < index.node(node).childCount; i++) {
+                const unsigned int child = index.node(node).firstChild + i;
+                if (index.isLink(child)) continue;
+                appendEntry(payload, child);
+                count++;
+            }
+            return reply(connection, STATUS_OK, count, payload);
+        }
+        if (request.type == REQUEST_STAT) {
+            std::vector<unsigned char> payload;
+            appendEntry(payload, node);
+            return reply(connection, STATUS_OK, 1, payload);
+        }
+
+        if (isDirectory) return reply(connection, STATUS_IS_A_DIRECTORY);
+        startFile(connection, index.node(node), request.offset, request.length);
+    }
+
+    void appendEntry(std::vector<unsigned char>& payload, unsigned int i) const {
+        const IndexNode& node = index.node(i);
+        const DirectoryEntry entry = index.toEntry(node);
+        const std::string name = i == 0 ? "/" : (entry.longFilename.empty() ? getShortName(entry) : entry.longFilename);
+
+        EntryInfo info = {};
+        info.size = node.size;
+        info.firstCluster = node.firstCluster;
+        info.creationTime = node.creationTime;
+        info.creationDate = node.creationDate;
+        info.lastAccessedDate = node.lastAccessedDate;
+        info.lastModificationTime = node.lastModificationTime;
+        info.lastModificationDate = node.lastModificationDate;
+        info.attributes = node.attributes;
+        info.nameLength = name.size();
+
+        payload.insert(payload.end(), (const unsigned char*)&info, (const unsigned char*)(&info + 1));
+        payload.insert(payload.end(), name.begin(), name.end());
+    }
+
+    void startFile(Connection& connection, const IndexNode& node, unsigned long long offset, unsigned long long length) {
+        const unsigned long long bytesPerCluster = bpb.sectorsPerCluster * bpb.bytesPerSector;
+        const Extent* extents = index.extents() + node.firstExtent;
+
+        unsigned long long allocated = 0;
+        for (unsigned int i = 0; i < node.extentCount; i++) allocated += extents[i].count * bytesPerCluster;
+        if (allocated < node.size) return reply(connection, STATUS_IO_ERROR); // the cluster chain is shorter than the file
+
+        if (offset > node.size) offset = node.size;
+        length = std::min<unsigned long long>(length, node.size - offset);
+        reply(connection, STATUS_OK);
+        ResponseHeader* header = (ResponseHeader*)connection.pending.data();
+        header->length = length;
+
+        connection.file = &node;
+        connection.fileOffset = offset;
+        connection.fileRemaining = length;
+        connection.extent = 0;
+        connection.extentStart = 0;
+    }
+
+    void reply(Connection& connection, ResponseStatus status, unsigned int count = 0,
+               const std::vector<unsigned char>& payload = std::vector<unsigned char>()) {
+        ResponseHeader header = {(unsigned int)status, count, payload.size()};
+        connection.pending.assign((const unsigned char*)&header, (const unsigned char*)(&header + 1));
+        connection.pending.insert(connection.pending.end(), payload.begin(), payload.end());
+        connection.pendingSent = 0;
+        connection.fileRemaining = 0;
+        connection.replying = true;
+    }
+
+    // Sends as much of the reply as the socket takes. Returns 1 when all of it was sent,
+    // 0 if the socket is full or the budget is used up, and -1 on failure (the connection can only be closed then).
+    int sendReply(Connection& connection, unsigned long long& budget) {
+        const unsigned long long bytesPerCluster = bpb.sectorsPerCluster * bpb.bytesPerSector;
+
+        while (true) {
+            while (connection.pendingSent < connection.pending.size()) {
+                const ssize_t sent = send(connection.fd, connection.pending.data() + connection.pendingSent,
+                                          connection.pending.size() - connection.pendingSent, MSG_NOSIGNAL);
+                if (sent < 0 && errno == EINTR) continue;
+                if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+                if (sent <= 0) return -1;
+                connection.pendingSent += sent;
+                budget -= std::min<unsigned long long>(budget, sent);
+            }
+            connection.pending.clear();
+            connection.pendingSent = 0;
+
+            if (connection.fileRemaining == 0) return 1;
+            if (budget == 0) return 0;
+
+            // the rest of the extent that holds the next byte
+            const Extent* extents = index.extents() + connection.file->firstExtent;
+            while (connection.extent < connection.file->extentCount &&
+                   connection.fileOffset >= connection.extentStart + extents[connection.extent].count * bytesPerCluster)
+                connection.extentStart += extents[connection.extent++].count * bytesPerCluster;
+            if (connection.extent >= connection.file->extentCount) return -1;
+
+            const Extent& extent = extents[connection.extent];
+            const unsigned long long position = getClusterAddress(bpb, sectorsPerFAT, extent.cluster) + connection.fileOffset - connection.extentStart;
+            unsigned long long length = std::min(connection.extentStart + extent.count * bytesPerCluster - connection.fileOffset,
+                                                 std::min(connection.fileRemaining, budget));
+
+            if (zeroCopy) {
+                off_t from = position;
+                const ssize_t sent = sendfile(connection.fd, driveFd, &from, length);
+                if (sent < 0 && errno == EINTR) continue;
+                if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+                if (sent < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                    zeroCopy = false; // not supported for this drive, copy from now on
+                    continue;
+                }
+                if (sent <= 0) return -1;
+                length = sent;
+            } else {
+                // whatever the socket doesn't take is kept and sent first next time, so nothing is read twice
+                PooledBuffer buffer(pool);
+                length = std::min<unsigned long long>(length, pool.maxRead());
+                const unsigned char* data = buffer.get() ? reader.read(position, length, buffer.get()) : nullptr;
+                if (!data) return -1;
+
+                const ssize_t sent = send(connection.fd, data, length, MSG_NOSIGNAL);
+                if (sent < 0 && errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+                connection.pending.assign(data + std::max<ssize_t>(sent, 0), data + length);
+            }
+
+            connection.fileOffset += length;
+            connection.fileRemaining -= length;
+            budget -= std::min(budget, length);
+        }
+    }
+
+    const VolumeIndex& index;
+    BPB bpb;
+    unsigned int sectorsPerFAT;
+    DataReader& reader;
+    unsigned int threadCount;
+    BufferPool pool; // one buffer for each thread, used when the data can't be sent with sendfile()
+    int driveFd;
+    int epollFd;
+    bool acceptFailing; // only used by the thread that runs the event loop
+
+    std::mutex lock; // protects everything below
+    std::condition_variable wakeUp;
+    std::deque<Connection*> ready; // connections that can make progress
+    std::map<int, std::unique_ptr<Connection>> connections;
+    bool stopping;
+
+    std::atomic<bool> zeroCopy;
+};
+
+#endif
\ No newline at end of file
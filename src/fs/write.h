@@ -0,0 +1,673 @@
+#ifndef WRITE_H
+#define WRITE_H
+
+#include "../extras.h"
+#include "cache.h"
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// A directory entry together with the location of the slots it occupies
+// (the long filename slots, if any, followed by the 8.3 slot)
+struct DirectoryRecord {
+    DirectoryEntry entry;
+    std::vector<size_t> slots; // indices into CachedDirectory::slots
+};
+
+// The raw contents of a directory, kept in memory until flush()
+struct CachedDirectory {
+    std::vector<unsigned long long> slots; // byte offset of every 32-byte slot on the disk
+    std::vector<unsigned char> data;
+    std::set<size_t> dirty;                // slots that were changed
+
+    // parsed entries, kept up to date with the raw data
+    std::map<size_t, DirectoryRecord> records;  // index of the 8.3 slot -> record
+    std::multimap<std::string, size_t> names;   // every name matchesName() accepts -> index of the 8.3 slot
+    std::set<std::string> shortNames;           // raw 11-character names
+};
+
+// Creates, overwrites, appends to and deletes files and directories.
+// FAT and directory changes are buffered and only reach the disk on flush(); file data is written right away.
+class VolumeWriter {
+public:
+    VolumeWriter(std::fstream& io, FSType fsType, BPB bpb, EBPB_32 ebpb, FSInfo fsInfo, unsigned int sectorsPerFAT)
+        : io(io), fsType(fsType), bpb(bpb), ebpb(ebpb), fsInfo(fsInfo), sectorsPerFAT(sectorsPerFAT),
+          fat(io, fsType, bpb, sectorsPerFAT), freeDelta(0), directoryWrites(0) {
+        // FSInfo tells us where the last allocation ended
+        nextFree = (fsType == FAT32) ? fsInfo.availableClusterStart : 2;
+    }
+
+    // Creates the file or replaces its contents. If `append` is set, the data is added to the end instead.
+    // `directory` is the first cluster of the directory, or -1 for the FAT12/16 root directory
+    bool writeFile(int directory, const std::string& name, std::istream& data, bool append) {
+        data.seekg(0, std::ios::end);
+        const unsigned long long size = data.tellg();
+        data.seekg(0);
+
+        DirectoryRecord record;
+        const bool exists = findRecord(directory, name, record);
+        if (exists && (record.entry.attributes & 0x10)) {
+            std::cerr << name << " is a directory" << std::endl;
+            return false;
+        }
+
+        const unsigned long long oldSize = (exists && append) ? record.entry.size : 0;
+        if (oldSize + size > 0xFFFFFFFF) {
+            std::cerr << "files can't be larger than 4 GiB on FAT" << std::endl;
+            return false;
+        }
+
+        const unsigned int bytesPerCluster = bpb.sectorsPerCluster * bpb.bytesPerSector;
+        unsigned int firstCluster = exists ? composeCluster(record.entry.firstClusterHigh, record.entry.firstClusterLow) : 0;
+        unsigned int lastCluster = 0;
+        unsigned long long tail = 0; // bytes that go into the last cluster the file already has
+
+        if (exists && !append && firstCluster != 0) {
+            // start looking at the old location, so a file of similar size stays where it was
+            freeDelta += freeChain(fat, firstCluster);
+            nextFree = firstCluster;
+            firstCluster = 0;
+
+            // if anything fails from here on, the file is left empty instead of pointing to free clusters
+            record.entry.firstClusterHigh = 0;
+            record.entry.firstClusterLow = 0;
+            record.entry.size = 0;
+            updateRecord(directory, record);
+        } else if (exists && append && firstCluster != 0) {
+            std::vector<Extent> extents;
+            readExtents(fat, firstCluster, extents);
+            lastCluster = extents.back().cluster + extents.back().count - 1;
+
+            // fill the unused space at the end of the last cluster first
+            if (oldSize % bytesPerCluster != 0) tail = std::min<unsigned long long>(size, bytesPerCluster - oldSize % bytesPerCluster);
+        }
+
+        std::vector<Extent> extents;
+        if (!allocate((size - tail + bytesPerCluster - 1) / bytesPerCluster, extents)) return false;
+        const std::vector<Extent> last = {{lastCluster, 1}};
+        if ((tail > 0 && !writeData(data, tail, last, oldSize % bytesPerCluster)) || !writeData(data, size - tail, extents, 0)) {
+            release(extents);
+            return false;
+        }
+        linkExtents(fat, extents, lastCluster);
+        if (firstCluster == 0 && !extents.empty()) firstCluster = extents.front().cluster;
+
+        if (!exists) {
+            if (addRecord(directory, name, 0x20, firstCluster, size)) return true;
+            if (firstCluster != 0) freeDelta += freeChain(fat, firstCluster);
+            return false;
+        }
+
+        setTimestamps(record.entry, false);
+        record.entry.firstClusterHigh = firstCluster >> 16;
+        record.entry.firstClusterLow = firstCluster & 0xFFFF;
+        record.entry.size = oldSize + size;
+        updateRecord(directory, record);
+        return true;
+    }
+
+    bool makeDirectory(int directory, const std::string& name) {
+        DirectoryRecord record;
+        if (findRecord(directory, name, record)) {
+            std::cerr << name << " already exists" << std::endl;
+            return false;
+        }
+
+        std::vector<Extent> extents;
+        if (!allocate(1, extents)) return false;
+        const unsigned int cluster = extents.front().cluster;
+        linkExtents(fat, extents, 0);
+
+        // the parent of a directory in the root is written as cluster 0
+        const bool parentIsRoot = directory == -1 || (fsType == FAT32 && (unsigned int)directory == ebpb.rootDirCluster);
+        CachedDirectory& created = loadDirectory(cluster);
+        std::fill(created.data.begin(), created.data.end(), 0);
+        for (size_t i = 0; i < created.slots.size(); i++) created.dirty.insert(i);
+        created.records.clear();
+        created.names.clear();
+        created.shortNames.clear();
+
+        DirectoryRecord dot, dotDot;
+        dot.entry = makeEntry(".", 0x10, cluster, 0);
+        dot.slots.push_back(0);
+        dotDot.entry = makeEntry("..", 0x10, parentIsRoot ? 0 : directory, 0);
+        dotDot.slots.push_back(1);
+        storeEntry(created, 0, dot.entry);
+        storeEntry(created, 1, dotDot.entry);
+        indexRecord(created, dot);
+        indexRecord(created, dotDot);
+
+        if (addRecord(directory, name, 0x10, cluster, 0)) return true;
+        directories.erase(cluster);
+        freeDelta += freeChain(fat, cluster);
+        return false;
+    }
+
+    // Deletes a file or an empty directory
+    bool remove(int directory, const std::string& name) {
+        // these belong to the directory itself and its parent, not to files in it
+        if (name == "." || name == "..") {
+            std::cerr << "cannot remove " << name << std::endl;
+            return false;
+        }
+
+        DirectoryRecord record;
+        if (!findRecord(directory, name, record)) {
+            std::cerr << "File " << name << " was not found." << std::endl;
+            return false;
+        }
+
+        const unsigned int firstCluster = composeCluster(record.entry.firstClusterHigh, record.entry.firstClusterLow);
+        if (record.entry.attributes & 0x10) {
+            const std::map<size_t, DirectoryRecord>& children = loadDirectory(firstCluster).records;
+            for (std::map<size_t, DirectoryRecord>::const_iterator it = children.begin(); it != children.end(); ++it) {
+                const std::string childName = getEntryName(it->second.entry);
+                if (childName != "." && childName != "..") {
+                    std::cerr << "Directory " << name << " is not empty." << std::endl;
+                    return false;
+                }
+            }
+            directories.erase(firstCluster);
+        }
+
+        if (firstCluster != 0) freeDelta += freeChain(fat, firstCluster);
+
+        CachedDirectory& parent = loadDirectory(directory);
+        for (size_t i = 0; i < record.slots.size(); i++) {
+            parent.data[record.slots[i] * 32] = 0xE5; // deleted entry
+            parent.dirty.insert(record.slots[i]);
+        }
+        unindexRecord(parent, record);
+        return true;
+    }
+
+    // Copies a directory tree from the host into the volume.
+    // The counters are increased by the number of files and directories that were written.
+    bool importDirectory(int directory, const std::filesystem::path& source, unsigned int& files, unsigned int& directoriesCreated) {
+        std::error_code error;
+        std::filesystem::directory_iterator it(source, error);
+        if (error) {
+            std::cerr << "could not read " << source << ": " << error.message() << std::endl;
+            return false;
+        }
+
+        for (; it != std::filesystem::directory_iterator(); it.increment(error)) {
+            const std::string name = it->path().filename().string();
+
+            if (it->is_directory(error)) {
+                DirectoryRecord record;
+                if (!findRecord(directory, name, record)) {
+                    if (!makeDirectory(directory, name)) return false;
+                    findRecord(directory, name, record);
+                    directoriesCreated++;
+                } else if (!(record.entry.attributes & 0x10)) {
+                    std::cerr << name << " exists and is not a directory" << std::endl;
+                    return false;
+                }
+
+                const int cluster = composeCluster(record.entry.firstClusterHigh, record.entry.firstClusterLow);
+                if (!importDirectory(cluster, it->path(), files, directoriesCreated)) return false;
+            } else if (it->is_regular_file(error)) {
+                std::ifstream data(it->path(), std::ios::binary);
+                if (!data || !writeFile(directory, name, data, false)) return false;
+                files++;
+            }
+        }
+        return true;
+    }
+
+    // Writes all the buffered changes: directories, the FATs (to every copy) and the FSInfo structure
+    void flush() {
+        for (std::map<int, CachedDirectory>::iterator it = directories.begin(); it != directories.end(); ++it) {
+            CachedDirectory& directory = it->second;
+            std::set<size_t>::iterator slot = directory.dirty.begin();
+
+            while (slot != directory.dirty.end()) {
+                // write consecutive slots that are also next to each other on the disk together
+                const size_t first = *slot;
+                size_t last = first;
+                for (++slot; slot != directory.dirty.end() && *slot == last + 1 &&
+                             directory.slots[*slot] == directory.slots[last] + 32; ++slot)
+                    last = *slot;
+
+                io.seekp(directory.slots[first]);
+                io.write((char*)&directory.data[first * 32], (last - first + 1) * 32);
+                directoryWrites++;
+            }
+            directory.dirty.clear();
+        }
+
+        fat.flush(io);
+
+        if (fsType == FAT32 && fsInfo.topSignature == 0x41615252 && fsInfo.middleSignature == 0x61417272) {
+            if (fsInfo.freeClusters != 0xFFFFFFFF) fsInfo.freeClusters += freeDelta;
+            fsInfo.availableClusterStart = nextFree;
+
+            io.seekp((unsigned long long)ebpb.FSInfoSector * bpb.bytesPerSector + 488);
+            write(fsInfo.freeClusters, io);
+            write(fsInfo.availableClusterStart, io);
+        }
+        freeDelta = 0;
+        io.flush();
+    }
+
+    FSInfo getFSInfo() const { return fsInfo; }
+
+    unsigned long long FATWrites() const { return fat.writes(); }
+    unsigned long long directoryWriteCount() const { return directoryWrites; }
+
+private:
+    bool allocate(unsigned long long count, std::vector<Extent>& extents) {
+        if (count == 0) return true;
+        if (count > fat.limit() || !allocateClusters(fat, count, nextFree, extents)) {
+            std::cerr << "not enough free space on the volume" << std::endl;
+            return false;
+        }
+
+        // mark the clusters as used right away, so the next allocation doesn't return them again
+        for (size_t i = 0; i < extents.size(); i++)
+            for (unsigned int j = 0; j < extents[i].count; j++)
+                fat.set(extents[i].cluster + j, fat.endOfChain());
+
+        nextFree = extents.back().cluster + extents.back().count;
+        freeDelta -= count;
+        return true;
+    }
+
+    // Frees clusters from allocate() that were never linked into a chain
+    void release(const std::vector<Extent>& extents) {
+        for (size_t i = 0; i < extents.size(); i++) {
+            for (unsigned int j = 0; j < extents[i].count; j++) fat.set(extents[i].cluster + j, 0);
+            freeDelta += extents[i].count;
+        }
+    }
+
+    // Writes `size` bytes from `data` into the extents, starting `offset` bytes into the first cluster
+    bool writeData(std::istream& data, unsigned long long size, const std::vector<Extent>& extents, unsigned int offset) {
+        const unsigned int bytesPerCluster = bpb.sectorsPerCluster * bpb.bytesPerSector;
+        std::vector<char> buffer;
+
+        for (size_t i = 0; i < extents.size() && size > 0; i++) {
+            unsigned long long length = std::min<unsigned long long>(size, (unsigned long long)extents[i].count * bytesPerCluster - offset);
+            io.seekp((unsigned long long)getClusterAddress(bpb, sectorsPerFAT, extents[i].cluster) + offset);
+            size -= length;
+            offset = 0;
+
+            // one write per extent, unless the extent is larger than the buffer
+            while (length > 0) {
+                const size_t chunk = std::min<unsigned long long>(length, 1 << 20);
+                buffer.resize(chunk);
+                data.read(buffer.data(), chunk);
+                if ((size_t)data.gcount() != chunk) {
+                    std::cerr << "could not read the source file" << std::endl;
+                    return false;
+                }
+                io.write(buffer.data(), chunk);
+                length -= chunk;
+            }
+        }
+
+        if (!io) {
+            std::cerr << "could not write to the drive" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    CachedDirectory& loadDirectory(int directory) {
+        std::map<int, CachedDirectory>::iterator found = directories.find(directory);
+        if (found != directories.end()) return found->second;
+
+        CachedDirectory& cached = directories[directory];
+        if (directory == -1) {
+            // The root directory on FAT12/16 is immediately after the FATs and has a fixed size
+            const unsigned long long start = (unsigned long long)(bpb.reservedSectors + bpb.FATs * sectorsPerFAT) * bpb.bytesPerSector;
+            for (unsigned int i = 0; i < bpb.rootDirectoryEntries; i++) cached.slots.push_back(start + i * 32);
+        } else {
+            std::vector<Extent> extents;
+            readExtents(fat, directory, extents);
+            for (size_t i = 0; i < extents.size(); i++) appendSlots(cached, extents[i]);
+        }
+
+        cached.data.resize(cached.slots.size() * 32);
+        for (size_t i = 0; i < cached.slots.size();) {
+            // read each run of consecutive slots at once
+            size_t j = i + 1;
+            while (j < cached.slots.size() && cached.slots[j] == cached.slots[j - 1] + 32) j++;
+            io.clear();
+            io.seekg(cached.slots[i]);
+            io.read((char*)&cached.data[i * 32], (j - i) * 32);
+            i = j;
+        }
+
+        std::vector<DirectoryRecord> records;
+        readRecords(cached, records);
+        for (size_t i = 0; i < records.size(); i++) indexRecord(cached, records[i]);
+        return cached;
+    }
+
+    // The names a record can be found by: its displayed name and its 8.3 name with a dot, in upper case
+    static void recordNames(const DirectoryRecord& record, std::string& name, std::string& shortName) {
+        name = getEntryName(record.entry);
+        shortName = getShortName(record.entry);
+    }
+
+    void indexRecord(CachedDirectory& directory, const DirectoryRecord& record) {
+        std::string name, shortName;
+        recordNames(record, name, shortName);
+
+        const size_t slot = record.slots.back();
+        directory.records[slot] = record;
+        directory.names.insert(std::make_pair(name, slot));
+        if (shortName != name) directory.names.insert(std::make_pair(shortName, slot));
+        directory.shortNames.insert(std::string((char*)record.entry.filename, 11));
+    }
+
+    void unindexRecord(CachedDirectory& directory, const DirectoryRecord& record) {
+        std::string names[2];
+        recordNames(record, names[0], names[1]);
+
+        const size_t slot = record.slots.back();
+        for (int i = 0; i < 2; i++) {
+            std::pair<std::multimap<std::string, size_t>::iterator, std::multimap<std::string, size_t>::iterator> range =
+                directory.names.equal_range(names[i]);
+            for (std::multimap<std::string, size_t>::iterator it = range.first; it != range.second; ++it) {
+                if (it->second == slot) {
+                    directory.names.erase(it);
+                    break;
+                }
+            }
+        }
+        directory.records.erase(slot);
+        directory.shortNames.erase(std::string((char*)record.entry.filename, 11));
+    }
+
+    void appendSlots(CachedDirectory& directory, Extent extent) {
+        const unsigned int bytesPerCluster = bpb.sectorsPerCluster * bpb.bytesPerSector;
+        const unsigned long long start = getClusterAddress(bpb, sectorsPerFAT, extent.cluster);
+        for (unsigned long long i = 0; i < (unsigned long long)extent.count * bytesPerCluster; i += 32)
+            directory.slots.push_back(start + i);
+    }
+
+    // Parses the raw directory in the same way as DirectoryIterator
+    void readRecords(const CachedDirectory& directory, std::vector<DirectoryRecord>& records) {
+        std::vector<std::u16string> longNameEntries;
+        std::vector<size_t> longNameSlots;
+
+        for (size_t i = 0; i < directory.slots.size(); i++) {
+            const unsigned char* slot = &directory.data[i * 32];
+            if (slot[0] == 0x00) break; // end of directory
+            if (slot[0] == 0xE5) {      // unused entry
+                longNameEntries.clear();
+                longNameSlots.clear();
+                continue;
+            }
+
+            // long filename entry
+            if (slot[11] == 0x0F) {
+                longNameEntries.push_back(parseLongNamePart(slot));
+                longNameSlots.push_back(i);
+                continue;
+            }
+
+            DirectoryRecord record;
+            DirectoryEntry& entry = record.entry;
+            parseShortEntry(slot, entry);
+
+            std::u16string longFilename;
+            for (int j = longNameEntries.size() - 1; j >= 0; j--) longFilename += longNameEntries[j];
+            entry.longFilename = toUTF8(longFilename);
+            record.slots = longNameSlots;
+            record.slots.push_back(i);
+            records.push_back(record);
+
+            longNameEntries.clear();
+            longNameSlots.clear();
+        }
+    }
+
+    bool findRecord(int directory, const std::string& name, DirectoryRecord& result) {
+        CachedDirectory& cached = loadDirectory(directory);
+
+        // the 8.3 name is compared case-insensitively, so it is also looked up in upper case
+        std::string upperName = name;
+        std::transform(upperName.begin(), upperName.end(), upperName.begin(), ::toupper);
+        const std::string keys[] = {name, upperName};
+
+        for (int i = 0; i < 2; i++) {
+            std::pair<std::multimap<std::string, size_t>::iterator, std::multimap<std::string, size_t>::iterator> range =
+                cached.names.equal_range(keys[i]);
+            for (std::multimap<std::string, size_t>::iterator it = range.first; it != range.second; ++it) {
+                const DirectoryRecord& record = cached.records[it->second];
+                if (record.entry.attributes & 0x08) continue; // volume label
+                if (matchesName(record.entry, name)) {
+                    result = record;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool addRecord(int directory, const std::string& name, unsigned char attributes, unsigned int cluster, unsigned int size) {
+        // these characters aren't allowed in long filenames either
+        const bool hasInvalidCharacter = std::find_if(name.begin(), name.end(), [](char c) {
+            return (unsigned char)c < 0x20 || strchr("\\/:*?\"<>|", c) != nullptr;
+        }) != name.end();
+        // long filenames are stored as UTF-16, and can be at most 255 code units long
+        std::u16string longName;
+        if (!toUTF16(name, longName) || longName.empty() || longName.size() > 255 || name == "." || name == ".." || hasInvalidCharacter) {
+            std::cerr << "invalid filename: " << name << std::endl;
+            return false;
+        }
+
+        CachedDirectory& cached = loadDirectory(directory);
+
+        bool needsLongName;
+        const std::string shortName = makeShortName(name, cached.shortNames, needsLongName);
+        const size_t longNameSlots = needsLongName ? (longName.size() + 12) / 13 : 0;
+        const size_t needed = longNameSlots + 1;
+
+        // look for enough consecutive free slots
+        size_t start = 0, run = 0;
+        for (size_t i = 0; i < cached.slots.size() && run < needed; i++) {
+            const unsigned char first = cached.data[i * 32];
+            if (first == 0x00 || first == 0xE5) {
+                if (run == 0) start = i;
+                run++;
+            } else
+                run = 0;
+        }
+
+        while (run < needed) {
+            if (directory == -1) {
+                std::cerr << "the root directory is full" << std::endl;
+                return false;
+            }
+
+            // grow the directory by one (zeroed) cluster
+            std::vector<Extent> extents;
+            if (!allocate(1, extents)) return false;
+            std::vector<Extent> chain;
+            readExtents(fat, directory, chain);
+            linkExtents(fat, extents, chain.back().cluster + chain.back().count - 1);
+
+            const size_t oldCount = cached.slots.size();
+            appendSlots(cached, extents.front());
+            cached.data.resize(cached.slots.size() * 32, 0);
+            for (size_t i = oldCount; i < cached.slots.size(); i++) cached.dirty.insert(i);
+
+            if (run == 0) start = oldCount;
+            run += cached.slots.size() - oldCount;
+        }
+
+        // the long filename entries are stored in reverse order before the 8.3 entry
+        unsigned char checksum = 0;
+        for (int i = 0; i < 11; i++) checksum = ((checksum & 1) << 7) + (checksum >> 1) + (unsigned char)shortName[i];
+
+        for (size_t i = 0; i < longNameSlots; i++) {
+            const size_t order = longNameSlots - i; // 1-based position of this part in the name
+            unsigned char* slot = &cached.data[(start + i) * 32];
+
+            memset(slot, 0, 32);
+            slot[0] = order | (i == 0 ? 0x40 : 0); // the last part is marked with 0x40
+            slot[11] = 0x0F;
+            slot[13] = checksum;
+            for (int j = 0; j < 13; j++) {
+                const size_t position = (order - 1) * 13 + j;
+                char16_t c = 0xFFFF; // padding after the terminator
+                if (position < longName.size()) c = longName[position];
+                else if (position == longName.size()) c = 0x0000;
+                slot[LFN_NAME_OFFSETS[j]] = c & 0xFF;
+                slot[LFN_NAME_OFFSETS[j] + 1] = c >> 8;
+            }
+            cached.dirty.insert(start + i);
+        }
+
+        DirectoryRecord record;
+        record.entry = makeEntry(shortName, attributes, cluster, size);
+        if (needsLongName) record.entry.longFilename = name;
+        for (size_t i = 0; i <= longNameSlots; i++) record.slots.push_back(start + i);
+        storeEntry(cached, start + longNameSlots, record.entry);
+
+        indexRecord(cached, record);
+        return true;
+    }
+
+    void updateRecord(int directory, const DirectoryRecord& record) {
+        CachedDirectory& cached = loadDirectory(directory);
+        storeEntry(cached, record.slots.back(), record.entry);
+        cached.records[record.slots.back()].entry = record.entry;
+    }
+
+    // Serializes an 8.3 entry into the given slot
+    void storeEntry(CachedDirectory& directory, size_t index, const DirectoryEntry& entry) {
+        unsigned char* slot = &directory.data[index * 32];
+        memcpy(slot, entry.filename, 11);
+        slot[11] = entry.attributes;
+        slot[12] = 0; // Reserved
+        slot[13] = entry.creationTimeHS;
+        const unsigned short fields[] = {entry.creationTime, entry.creationDate, entry.lastAccessedDate, entry.firstClusterHigh,
+                                         entry.lastModificationTime, entry.lastModificationDate, entry.firstClusterLow};
+        for (int i = 0; i < 7; i++) {
+            slot[14 + i * 2] = fields[i] & 0xFF;
+            slot[15 + i * 2] = fields[i] >> 8;
+        }
+        for (int i = 0; i < 4; i++) slot[28 + i] = (entry.size >> (i * 8)) & 0xFF;
+        directory.dirty.insert(index);
+    }
+
+    DirectoryEntry makeEntry(const std::string& shortName, unsigned char attributes, unsigned int cluster, unsigned int size) {
+        DirectoryEntry entry;
+        std::string padded = shortName;
+        padded.resize(11, ' ');
+        memcpy(entry.filename, padded.data(), 11);
+        entry.filename[11] = '\0';
+        entry.attributes = attributes;
+        entry.creationTimeHS = 0;
+        entry.firstClusterHigh = cluster >> 16;
+        entry.firstClusterLow = cluster & 0xFFFF;
+        entry.size = size;
+        setTimestamps(entry, true);
+        return entry;
+    }
+
+    void setTimestamps(DirectoryEntry& entry, bool creation) {
+        std::time_t now = std::time(nullptr);
+        std::tm* local = std::localtime(&now);
+        const unsigned short date = ((local->tm_year - 80) << 9) | ((local->tm_mon + 1) << 5) | local->tm_mday;
+        const unsigned short time = (local->tm_hour << 11) | (local->tm_min << 5) | (local->tm_sec / 2);
+
+        if (creation) {
+            entry.creationTime = time;
+            entry.creationDate = date;
+        }
+        entry.lastModificationTime = time;
+        entry.lastModificationDate = date;
+        entry.lastAccessedDate = date;
+    }
+
+    // Returns the 11-character 8.3 name for `name`. If the name doesn't fit, a numbered
+    // short name ("LONGFI~1TXT") is generated and a long filename is needed as well.
+    static std::string makeShortName(const std::string& name, const std::set<std::string>& existing, bool& needsLongName) {
+        static const std::string allowed = "!#$%&'()-@^_`{}~";
+        const size_t dot = name.find_last_of('.');
+        std::string base = (dot == std::string::npos || dot == 0) ? name : name.substr(0, dot);
+        std::string extension = (dot == std::string::npos || dot == 0) ? "" : name.substr(dot + 1);
+
+        needsLongName = false;
+        std::string shortBase, shortExtension;
+        for (size_t i = 0; i < base.size(); i++) {
+            const unsigned char c = base[i];
+            if ((c & 0xC0) == 0x80) continue; // the rest of a UTF-8 character, which became a single '_'
+            if (std::isalnum(c) && c < 0x80 && !std::islower(c)) shortBase.push_back(c);
+            else if (c < 0x80 && allowed.find(c) != std::string::npos) shortBase.push_back(c);
+            else {
+                needsLongName = true;
+                if (c == ' ' || c == '.') continue; // these are just dropped
+                shortBase.push_back((c < 0x80 && std::isalnum(c)) ? std::toupper(c) : '_');
+            }
+        }
+        for (size_t i = 0; i < extension.size(); i++) {
+            const unsigned char c = extension[i];
+            if ((c & 0xC0) == 0x80) continue;
+            if ((std::isalnum(c) && c < 0x80 && !std::islower(c)) || (c < 0x80 && allowed.find(c) != std::string::npos)) shortExtension.push_back(c);
+            else {
+                needsLongName = true;
+                if (c == ' ') continue;
+                shortExtension.push_back((c < 0x80 && std::isalnum(c)) ? std::toupper(c) : '_');
+            }
+        }
+        if (shortBase.empty()) {
+            shortBase = "_";
+            needsLongName = true;
+        }
+        if (shortBase.size() > 8 || shortExtension.size() > 3) needsLongName = true;
+
+        shortExtension.resize(std::min<size_t>(shortExtension.size(), 3));
+        shortExtension.resize(3, ' ');
+        if (!needsLongName) {
+            shortBase.resize(8, ' ');
+            const std::string result = shortBase + shortExtension;
+            if (!existing.count(result)) return result;
+            needsLongName = true; // only the case differs from an existing name
+        }
+
+        for (unsigned int i = 1;; i++) {
+            // Like Windows, after a few tries part of the name is replaced with a hash of the long name,
+            // so thousands of similar names don't have to go through all the numbers one by one
+            std::string basis = shortBase;
+            if (i > 4) {
+                unsigned short hash = 0;
+                for (size_t j = 0; j < name.size(); j++) hash = hash * 37 + (unsigned char)name[j];
+                std::ostringstream stream;
+                stream << std::hex << std::uppercase << std::setw(4) << std::setfill('0') << hash;
+                basis = shortBase.substr(0, std::min<size_t>(shortBase.size(), 2)) + stream.str();
+            }
+
+            const std::string tail = "~" + std::to_string(i > 4 ? i - 4 : i);
+            std::string numbered = basis.substr(0, std::min<size_t>(basis.size(), 8 - tail.size())) + tail;
+            numbered.resize(8, ' ');
+            if (!existing.count(numbered + shortExtension)) return numbered + shortExtension;
+        }
+    }
+
+    std::fstream& io;
+    FSType fsType;
+    BPB bpb;
+    EBPB_32 ebpb;
+    FSInfo fsInfo;
+    unsigned int sectorsPerFAT;
+
+    FATCache fat;
+    std::map<int, CachedDirectory> directories; // first cluster (-1 for the FAT12/16 root) -> contents
+    unsigned int nextFree;
+    int freeDelta; // change in the number of free clusters since the last flush
+    unsigned long long directoryWrites;
+};
+
+#endif
@@ -2,14 +2,97 @@
 #include <ios>
 #include <iostream>
 #include <cstring>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "extras.h"
+#include "fs/cache.h"
 #include "fs/common.h"
-#include "fs/fat16.h"
+#include "fs/diff.h"
+#include "fs/directory.h"
+#include "fs/index.h"
+#include "fs/owners.h"
+#include "fs/server.h"
+#include "fs/write.h"
 
-std::vector<DirectoryEntry> currentDirEntries;
+int currentDirCluster; // -1 for the FAT12/16 root directory
+
+VolumeIndex volumeIndex;
+unsigned int currentDirNode; // only used if the index is loaded
+
+// Built the first time someone asks who owns a sector
+OwnerMap ownerMap;
+
+// Without --index, an index is built in memory the first time a command needs one
+VolumeIndex memoryIndex;
+
+const VolumeIndex& getIndex(std::ifstream& in, FSType fsType, BPB bpb, EBPB_32 ebpb, unsigned int sectorsPerFAT, unsigned int volumeId) {
+    if (volumeIndex.isLoaded()) return volumeIndex;
+    if (!memoryIndex.isLoaded()) {
+        std::vector<unsigned long long> checksums;
+        checksumFAT(in, bpb, sectorsPerFAT, checksums);
+        memoryIndex.build(in, fsType, bpb, ebpb, sectorsPerFAT, volumeId, checksums);
+    }
+    return memoryIndex;
+}
+
+void enterIndexedDirectory(unsigned int node) {
+    currentDirNode = node;
+    currentDirCluster = (node == 0 && volumeIndex.node(0).firstCluster == 0) ? -1 : volumeIndex.node(node).firstCluster;
+}
+
+void changeDirectory(FSType fsType, EBPB_32 ebpb, int cluster) {
+    // ".." entries point to cluster 0 when the parent is the root directory
+    if (cluster == 0) cluster = (fsType == FAT32) ? ebpb.rootDirCluster : -1;
+
+    if (volumeIndex.isLoaded()) {
+        unsigned int node = volumeIndex.findDirectory(cluster == -1 ? 0 : cluster);
+        if (node != NO_NODE) {
+            enterIndexedDirectory(node);
+            return;
+        }
+    }
+
+    currentDirCluster = cluster;
+}
+
+// Prints the current directory. Without the index, each entry is printed as soon as it is read.
+void listDirectory(FSType fsType, std::ifstream& in, BPB bpb, unsigned int sectorsPerFAT) {
+    if (volumeIndex.isLoaded()) {
+        const IndexNode& directory = volumeIndex.node(currentDirNode);
+        for (unsigned int i = 0; i < directory.childCount; i++)
+            printDirectoryEntry(volumeIndex.toEntry(volumeIndex.node(directory.firstChild + i)));
+        return;
+    }
+
+    DirectoryIterator directory(in, fsType, bpb, sectorsPerFAT, currentDirCluster);
+    DirectoryEntry entry;
+    while (directory.next(entry)) printDirectoryEntry(entry);
+}
+
+// Looks for `name` in the current directory and stops at the first match.
+// If the index is loaded, `node` is set to the entry's node.
+bool findEntry(FSType fsType, std::ifstream& in, BPB bpb, unsigned int sectorsPerFAT, const std::string& name,
+               DirectoryEntry& entry, unsigned int& node) {
+    if (volumeIndex.isLoaded()) {
+        const IndexNode& directory = volumeIndex.node(currentDirNode);
+        for (unsigned int i = 0; i < directory.childCount; i++) {
+            entry = volumeIndex.toEntry(volumeIndex.node(directory.firstChild + i));
+            if (getEntryName(entry) == name) {
+                node = directory.firstChild + i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    DirectoryIterator directory(in, fsType, bpb, sectorsPerFAT, currentDirCluster);
+    while (directory.next(entry))
+        if (getEntryName(entry) == name) return true;
+    return false;
+}
 
 int main(int argc, const char** argv) {
     BPB bpb;
@@ -19,11 +102,27 @@ int main(int argc, const char** argv) {
 
     FSType fsType;
 
-    int sectorsPerFAT = 0;
+    unsigned int sectorsPerFAT = 0;
 
-    // check argument count
-    if (argc != 2) {
-        std::cerr << "usage: " << argv[0] << " <input drive>" << std::endl;
+    // check arguments
+    bool writable = false;
+    bool direct = false;
+    const char* indexPath = nullptr;
+    const char* socketPath = nullptr;
+    bool validArguments = argc >= 2;
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--write")) writable = true;
+        else if (!strcmp(argv[i], "--direct")) direct = true;
+        else if (!strcmp(argv[i], "--index") && i + 1 < argc) indexPath = argv[++i];
+        else if (!strcmp(argv[i], "--serve") && i + 1 < argc) socketPath = argv[++i];
+        else validArguments = false;
+    }
+    if (writable && socketPath) {
+        std::cerr << "--write and --serve can't be used together" << std::endl;
+        validArguments = false;
+    }
+    if (!validArguments) {
+        std::cerr << "usage: " << argv[0] << " <input drive> [--write] [--direct] [--index <index file>] [--serve <socket>]" << std::endl;
         return -1;
     }
 
@@ -34,8 +133,17 @@ int main(int argc, const char** argv) {
         return -1; 
     } else
         std::cout << "Drive opened." << std::endl;
-    
-    readBPB(&bpb, in);
+
+    in.seekg(0, std::ios::end);
+    const std::streamoff end = in.tellg();
+    const unsigned long long driveSize = end > 0 ? end : 0; // 0 if the size can't be known
+    in.clear();
+    in.seekg(0);
+
+    if (!readBPB(&bpb, in)) {
+        std::cerr << "could not read the boot sector!" << std::endl;
+        return -1;
+    }
     if (bpb.jmp[0] == 0xEB && bpb.jmp[2] == 0x90) {
         std::cout << "FAT image detected (by JMP signature)" << std::endl;
     } else {
@@ -52,9 +160,6 @@ int main(int argc, const char** argv) {
         fat32::readEBPB(&ebpb_32, in);
         sectorsPerFAT = ebpb_32.sectorsPerFAT;
         fat32::readFSInfo(bpb, ebpb_32, &fsInfo, in);
-
-        // Read root directory
-        fat32::readDirectory(in, bpb, ebpb_32, ebpb_32.rootDirCluster, currentDirEntries);
     } else {
         sectorsPerFAT = bpb.sectorsPerFAT;
         if (fsType == FAT16) {
@@ -63,10 +168,56 @@ int main(int argc, const char** argv) {
             std::cout << "Filesystem detected as FAT12" << std::endl;
 
         // These steps are common for both FAT16 and FAT12
-
         readEBPB(&ebpb, in);
-        // Read root directory (cluster -1 for the root directory)
-        readDirectory(fsType, in, bpb, -1, currentDirEntries);
+    }
+
+    if (!checkGeometry(fsType, bpb, sectorsPerFAT, fsType == FAT32 ? ebpb_32.rootDirCluster : 0, driveSize)) {
+        std::cerr << "The boot sector doesn't describe a valid FAT volume. Exiting." << std::endl;
+        return -1;
+    }
+
+    // File data is read separately, into aligned buffers of at least 1 MiB
+    DataReader dataReader;
+    if (!dataReader.open(argv[1], direct)) {
+        std::cerr << "could not open drive!" << std::endl;
+        return -1;
+    }
+    if (dataReader.isDirect()) std::cout << "File data will be read with O_DIRECT." << std::endl;
+    const size_t bytesPerCluster = bpb.sectorsPerCluster * bpb.bytesPerSector;
+    BufferPool bufferPool(std::max<size_t>(bytesPerCluster, 1 << 20) + DIRECT_ALIGNMENT, 1);
+
+    const unsigned int volumeId = (fsType == FAT32) ? ebpb_32.volumeId : ebpb.volumeId;
+    if (indexPath) openIndex(volumeIndex, indexPath, argv[1], in, fsType, bpb, ebpb_32, sectorsPerFAT, volumeId);
+
+    if (socketPath) {
+        // The server works only from the index, so all the metadata is read once and shared by every client
+        if (!volumeIndex.isLoaded()) {
+            std::vector<unsigned long long> checksums;
+            checksumFAT(in, bpb, sectorsPerFAT, checksums);
+            volumeIndex.build(in, fsType, bpb, ebpb_32, sectorsPerFAT, volumeId, checksums);
+        }
+
+        const unsigned int threads = std::min(std::max(std::thread::hardware_concurrency(), 2u), 16u);
+        VolumeServer server(volumeIndex, bpb, sectorsPerFAT, dataReader, argv[1], threads);
+        const bool success = server.run(socketPath);
+        in.close();
+        return success ? 0 : -1;
+    }
+
+    // Start in the root directory (cluster -1 for the root directory on FAT12/16)
+    changeDirectory(fsType, ebpb_32, (fsType == FAT32) ? ebpb_32.rootDirCluster : -1);
+
+    // Changes go through a second stream, opened for both reading and writing
+    std::fstream io;
+    std::unique_ptr<VolumeWriter> writer;
+    if (writable) {
+        io.open(argv[1], std::ios::binary | std::ios::in | std::ios::out);
+        if (!io) {
+            std::cerr << "could not open drive for writing!" << std::endl;
+            return -1;
+        }
+        writer.reset(new VolumeWriter(io, fsType, bpb, ebpb_32, fsInfo, sectorsPerFAT));
+        std::cout << "Drive opened for writing." << std::endl;
     }
     while (true) {
         std::cout << std::endl << "> ";
@@ -87,62 +238,142 @@ int main(int argc, const char** argv) {
                 std::cout << std::endl << "**** Info for FSInfo structure (Filesystem info) ****" << std::endl;
                 printFSInfo(fsInfo);
             }
+
+            if (volumeIndex.isLoaded()) {
+                std::cout << std::endl << "**** Info from the index ****" << std::endl;
+                printIndexInfo(volumeIndex);
+            }
         } else if (command == "fileinfo") {
             std::string filename;
 
             std::cout << "Filename: ";
             std::getline(std::cin, filename, '\n');
 
-            bool found = false;
-            for (int i = 0; i < currentDirEntries.size(); i++) {
-                DirectoryEntry entry = currentDirEntries.at(i);
-                bool hasLongFilename = !entry.longFilename.empty();
-                std::string entryFilename;
-                if (hasLongFilename)
-                    entryFilename = entry.longFilename;
-                else
-                    entryFilename = std::string((char*)(entry.filename));
-                rtrim(entryFilename);
-                if (entryFilename == filename) {
-                    printDirectoryEntryInfo(entry);
-                    found = true;
-                    break;
+            DirectoryEntry entry;
+            unsigned int node;
+            if (findEntry(fsType, in, bpb, sectorsPerFAT, filename, entry, node)) printDirectoryEntryInfo(entry);
+            else std::cout << "File " << filename << " was not found." << std::endl;
+        } else if (command == "ls") {
+            listDirectory(fsType, in, bpb, sectorsPerFAT);
+        } else if (command == "put" || command == "append" || command == "mkdir" || command == "rm" || command == "import") {
+            if (!writer) {
+                std::cout << "The drive is read-only. Open it with --write to make changes." << std::endl;
+                continue;
+            }
+
+            bool success;
+            if (command == "put" || command == "append") {
+                std::string source, filename;
+                std::cout << "Source file: ";
+                std::getline(std::cin, source, '\n');
+                std::cout << "Filename: ";
+                std::getline(std::cin, filename, '\n');
+
+                std::ifstream data(source, std::ios::binary);
+                if (!data) {
+                    std::cerr << "could not open " << source << std::endl;
+                    continue;
                 }
+                success = writer->writeFile(currentDirCluster, filename, data, command == "append");
+            } else if (command == "mkdir") {
+                std::string name;
+                std::cout << "Directory name: ";
+                std::getline(std::cin, name, '\n');
+                success = writer->makeDirectory(currentDirCluster, name);
+            } else if (command == "rm") {
+                std::string filename;
+                std::cout << "Filename: ";
+                std::getline(std::cin, filename, '\n');
+                success = writer->remove(currentDirCluster, filename);
+            } else {
+                std::string source;
+                std::cout << "Source directory: ";
+                std::getline(std::cin, source, '\n');
+
+                unsigned int files = 0, directories = 0;
+                success = writer->importDirectory(currentDirCluster, source, files, directories);
+                std::cout << std::dec << "Imported " << files << " files and " << directories << " directories." << std::endl;
             }
 
-            if (!found) std::cout << "File " << filename << " was not found." << std::endl;
-        } else if (command == "ls") {
-            for (int i = 0; i < currentDirEntries.size(); i++) {
-                printDirectoryEntry(currentDirEntries.at(i));
+            // whatever was done before a failure is still written, so the volume stays consistent
+            const unsigned long long FATWrites = writer->FATWrites();
+            writer->flush();
+            fsInfo = writer->getFSInfo();
+            if (indexPath) openIndex(volumeIndex, indexPath, argv[1], in, fsType, bpb, ebpb_32, sectorsPerFAT, volumeId, true);
+            ownerMap.clear();
+            memoryIndex.close();
+            changeDirectory(fsType, ebpb_32, currentDirCluster);
+
+            if (success) std::cout << std::dec << "Done (" << writer->FATWrites() - FATWrites << " FAT writes)." << std::endl;
+        } else if (command.rfind("owner ", 0) == 0 || command.rfind("owners ", 0) == 0) {
+            const VolumeIndex& index = getIndex(in, fsType, bpb, ebpb_32, sectorsPerFAT, volumeId);
+            if (!ownerMap.isBuilt()) {
+                ownerMap.build(index);
+                std::cout << std::dec << "Mapped " << ownerMap.size() << " extents to their files." << std::endl;
             }
+
+            FATCache fat(in, fsType, bpb, sectorsPerFAT);
+            unsigned long long offset;
+            if (command.rfind("owner ", 0) == 0) {
+                const std::string query = command.substr(6);
+                if (parseLocation(query, bpb, sectorsPerFAT, offset))
+                    std::cout << describeLocation(offset, fsType, bpb, sectorsPerFAT, ownerMap, index, fat) << std::endl;
+                else
+                    std::cout << "usage: owner <sector|cluster|byte> <number>" << std::endl;
+            } else {
+                // one location per line, the answers are printed in the same order
+                std::ifstream queries(command.substr(7));
+                if (!queries) {
+                    std::cerr << "could not open " << command.substr(7) << std::endl;
+                    continue;
+                }
+
+                std::string query;
+                while (std::getline(queries, query)) {
+                    rtrim(query);
+                    if (query.empty()) continue;
+                    std::cout << query << '\t';
+                    if (parseLocation(query, bpb, sectorsPerFAT, offset))
+                        std::cout << describeLocation(offset, fsType, bpb, sectorsPerFAT, ownerMap, index, fat) << std::endl;
+                    else
+                        std::cout << "invalid location" << std::endl;
+                }
+            }
+        } else if (command.rfind("diff ", 0) == 0) {
+            Volume other;
+            if (!openVolume(command.substr(5), direct, other)) continue;
+
+            const unsigned int threads = std::min(std::max(std::thread::hardware_concurrency(), 2u), 16u);
+            DiffSide current = {&getIndex(in, fsType, bpb, ebpb_32, sectorsPerFAT, volumeId), bpb, sectorsPerFAT, &dataReader};
+            DiffSide second = {&other.index, other.bpb, other.sectorsPerFAT, &other.reader};
+            VolumeDiff diff(current, second, threads);
+            diff.run();
         } else if (command == "exit" || command == "quit") {
             break;
         } else {
-            bool found = false;
-            for (int i = 0; i < currentDirEntries.size(); i++) {
-                DirectoryEntry entry = currentDirEntries.at(i);
-                bool hasLongFilename = !entry.longFilename.empty();
-                std::string entryFilename;
-                if (hasLongFilename)
-                    entryFilename = entry.longFilename;
-                else
-                    entryFilename = std::string((char*)(entry.filename));
-                rtrim(entryFilename);
-                if (entryFilename == command) {
-                    bool isDirectory = (entry.attributes & 0x10) != 0;
-                    if (!isDirectory)
-                        readFile(fsType, bpb, sectorsPerFAT, entry, in);
-                    else {
-                        const int firstCluster = composeCluster(entry.firstClusterHigh, entry.firstClusterLow);
-                        currentDirEntries.clear();
-                        if (fsType == FAT32) fat32::readDirectory(in, bpb, ebpb_32, firstCluster, currentDirEntries);
-                        else if (fsType == FAT16) readDirectory(FAT16, in, bpb, firstCluster, currentDirEntries);
-                        std::cout << "Switched to directory " << entryFilename << std::endl;
+            DirectoryEntry entry;
+            unsigned int node;
+            if (findEntry(fsType, in, bpb, sectorsPerFAT, command, entry, node)) {
+                bool isDirectory = (entry.attributes & 0x10) != 0;
+                if (!isDirectory) {
+                    std::vector<Extent> extents;
+                    if (volumeIndex.isLoaded()) {
+                        const IndexNode& file = volumeIndex.node(node);
+                        extents.assign(volumeIndex.extents() + file.firstExtent, volumeIndex.extents() + file.firstExtent + file.extentCount);
+                    } else {
+                        FATCache fat(in, fsType, bpb, sectorsPerFAT);
+                        readExtents(fat, composeCluster(entry.firstClusterHigh, entry.firstClusterLow), extents);
                     }
-                    found = true;
+                    readFile(bpb, sectorsPerFAT, entry, extents, dataReader, bufferPool);
+                } else {
+                    if (volumeIndex.isLoaded())
+                        enterIndexedDirectory(volumeIndex.enter(currentDirNode, node));
+                    else
+                        changeDirectory(fsType, ebpb_32, composeCluster(entry.firstClusterHigh, entry.firstClusterLow));
+                    std::cout << "Switched to directory " << command << std::endl;
                 }
-            }
-            if (!found) std::cout << "Unknown command." << std::endl;
+            } else
+                std::cout << "Unknown command." << std::endl;
         }
     }
 
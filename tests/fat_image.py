@@ -0,0 +1,222 @@
+"""Builds FAT12, FAT16 and FAT32 images for the tests, and reads them back without going through main.out, so that
+the tests can check what was really written to the disk.
+"""
+import struct
+
+END_OF_CHAIN = {12: 0xFFF, 16: 0xFFFF, 32: 0x0FFFFFFF}
+
+
+def entry(name, attributes, cluster, size):
+    """A 32-byte 8.3 directory entry, dated 01/01/2020"""
+    return name.encode().ljust(11) + bytes([attributes, 0, 0]) + \
+        struct.pack('<HHHHHHHI', 0, 0x5021, 0x5021, cluster >> 16, 0, 0x5021, cluster & 0xFFFF, size)
+
+
+class FATImage:
+    """An empty, formatted volume in a (sparse) file. Clusters are used with set_fat() and address(); close() writes
+    the FSInfo free count of FAT32 volumes from the clusters that were used. A negative root_cluster counts from the
+    end of the volume (-1 is the last cluster)."""
+
+    def __init__(self, path, bits, size, bytes_per_sector=512, sectors_per_cluster=1, fats=2, root_cluster=2):
+        self.bits = bits
+        self.bytes_per_sector = bytes_per_sector
+        self.bytes_per_cluster = bytes_per_sector * sectors_per_cluster
+        self.fats = fats
+        self.total = size // bytes_per_sector
+        self.reserved = 32 if bits == 32 else 1
+        root_entries = 0 if bits == 32 else 512
+        root_sectors = root_entries * 32 // bytes_per_sector
+
+        # the FAT is sized for every sector being a cluster, which is a bit more than needed
+        self.sectors_per_fat = ((self.total // sectors_per_cluster + 2) * bits // 8 + bytes_per_sector - 1) // bytes_per_sector
+        self.root_start = self.reserved + fats * self.sectors_per_fat
+        self.data_start = self.root_start + root_sectors
+        self.clusters = (self.total - self.data_start) // sectors_per_cluster
+        expected = 12 if self.clusters < 4085 else (16 if self.clusters < 65525 else 32)
+        assert expected == bits, '%d clusters make a FAT%d volume, not FAT%d' % (self.clusters, expected, bits)
+        assert self.clusters <= 0x0FFFFFF5, 'too many clusters for FAT32'
+        self.root_cluster = 0 if bits != 32 else (root_cluster if root_cluster >= 0 else self.clusters + 2 + root_cluster)
+        self.used = set()
+
+        self.file = open(path, 'w+b')
+        self.file.truncate(self.total * bytes_per_sector)
+
+        boot = bytearray(512)
+        boot[0:3] = b'\xEB\x58\x90' if bits == 32 else b'\xEB\x3C\x90'
+        boot[3:11] = b'FATTEST '
+        struct.pack_into('<HBHBHHBHHHII', boot, 11, bytes_per_sector, sectors_per_cluster, self.reserved, fats,
+                         root_entries, self.total if self.total < 0x10000 else 0, 0xF8,
+                         0 if bits == 32 else self.sectors_per_fat, 63, 255, 0, self.total if self.total >= 0x10000 else 0)
+        if bits == 32:
+            struct.pack_into('<IHHIHH', boot, 36, self.sectors_per_fat, 0, 0, self.root_cluster, 1, 6)
+            boot[64], boot[66] = 0x80, 0x29
+            struct.pack_into('<I', boot, 67, 0x12345678)
+            boot[71:90] = b'TEST       FAT32   '
+        else:
+            boot[36], boot[38] = 0x80, 0x29
+            struct.pack_into('<I', boot, 39, 0x12345678)
+            boot[43:62] = b'TEST       ' + ('FAT%d   ' % bits).encode()
+        boot[510:512] = b'\x55\xAA'
+        self.file.write(boot)
+
+        self.set_fat(0, END_OF_CHAIN[bits] & ~7)
+        self.set_fat(1, END_OF_CHAIN[bits])
+        if bits == 32:
+            self.set_fat(self.root_cluster, END_OF_CHAIN[bits])
+
+    def set_fat(self, cluster, value):
+        for i in range(self.fats):
+            start = (self.reserved + i * self.sectors_per_fat) * self.bytes_per_sector
+            if self.bits == 12:
+                # two entries share three bytes
+                self.file.seek(start + cluster * 3 // 2)
+                old = struct.unpack('<H', self.file.read(2))[0]
+                new = (old & 0x000F) | (value << 4) if cluster & 1 else (old & 0xF000) | value
+                self.file.seek(start + cluster * 3 // 2)
+                self.file.write(struct.pack('<H', new))
+            else:
+                self.file.seek(start + cluster * self.bits // 8)
+                self.file.write(struct.pack('<I' if self.bits == 32 else '<H', value))
+        if cluster >= 2:
+            if value:
+                self.used.add(cluster)
+            else:
+                self.used.discard(cluster)
+
+    def address(self, cluster):
+        """Where a cluster starts, or the FAT12/16 root directory for cluster 0"""
+        if cluster == 0:
+            return self.root_start * self.bytes_per_sector
+        return self.data_start * self.bytes_per_sector + (cluster - 2) * self.bytes_per_cluster
+
+    def write(self, position, data):
+        self.file.seek(position)
+        self.file.write(data)
+
+    def close(self):
+        if self.bits == 32:
+            fsinfo = bytearray(512)
+            struct.pack_into('<I', fsinfo, 0, 0x41615252)
+            struct.pack_into('<III', fsinfo, 484, 0x61417272, self.clusters - len(self.used), 3)
+            struct.pack_into('<I', fsinfo, 508, 0xAA550000)
+            self.write(self.bytes_per_sector, fsinfo)
+        self.file.close()
+
+
+def read_volume(path):
+    """Reads the whole tree of an image from the boot sector up. Returns the files ({path: data}), the directories
+    and a list of the problems that were found: FAT copies that differ, broken, shared or lost cluster chains,
+    wrong '.' and '..' entries, and (on FAT32) a free count in FSInfo that doesn't match the FAT."""
+    with open(path, 'rb') as f:
+        image = f.read()
+
+    bytes_per_sector, sectors_per_cluster, reserved, fats, root_entries, total16 = struct.unpack_from('<HBHBHH', image, 11)
+    sectors_per_fat, total32 = struct.unpack_from('<H', image, 22)[0], struct.unpack_from('<I', image, 32)[0]
+    bits = 32 if sectors_per_fat == 0 else None
+    if bits == 32:
+        sectors_per_fat, root_cluster, fsinfo_sector = struct.unpack_from('<I4xIH', image, 36)
+    total = total16 or total32
+    root_start = reserved + fats * sectors_per_fat
+    data_start = root_start + (root_entries * 32 + bytes_per_sector - 1) // bytes_per_sector
+    clusters = (total - data_start) // sectors_per_cluster
+    if bits is None:
+        bits = 12 if clusters < 4085 else 16
+    bytes_per_cluster = bytes_per_sector * sectors_per_cluster
+    end_of_chain = END_OF_CHAIN[bits] & ~7
+    problems = []
+
+    copies = [image[(reserved + i * sectors_per_fat) * bytes_per_sector:(reserved + (i + 1) * sectors_per_fat) * bytes_per_sector]
+              for i in range(fats)]
+    for i in range(1, fats):
+        if copies[i] != copies[0]:
+            problems.append('FAT copy %d differs from the first one' % (i + 1))
+
+    def next_cluster(cluster):
+        if bits == 12:
+            value = struct.unpack_from('<H', copies[0], cluster * 3 // 2)[0]
+            return value >> 4 if cluster & 1 else value & 0xFFF
+        if bits == 16:
+            return struct.unpack_from('<H', copies[0], cluster * 2)[0]
+        return struct.unpack_from('<I', copies[0], cluster * 4)[0] & 0x0FFFFFFF
+
+    owners = {}
+
+    def chain(cluster, owner):
+        result = []
+        while cluster < end_of_chain:
+            if cluster < 2 or cluster >= clusters + 2:
+                problems.append('%s: chain goes to cluster %d' % (owner, cluster))
+                break
+            if cluster in owners:
+                problems.append('%s: cluster %d is also used by %s' % (owner, cluster, owners[cluster]))
+                break
+            owners[cluster] = owner
+            result.append(cluster)
+            cluster = next_cluster(cluster)
+        return result
+
+    def read_chain(cluster, owner):
+        offset = lambda c: (data_start + (c - 2) * sectors_per_cluster) * bytes_per_sector
+        return b''.join(image[offset(c):offset(c) + bytes_per_cluster] for c in chain(cluster, owner))
+
+    files, directories = {}, []
+
+    def walk(cluster, path, parent):
+        if cluster == 0 and bits != 32:
+            start = root_start * bytes_per_sector
+            data = image[start:start + root_entries * 32]
+        else:
+            data = read_chain(cluster, path or '/')
+        directories.append(path or '/')
+
+        long_name = []
+        for i in range(0, len(data), 32):
+            slot = data[i:i + 32]
+            if slot[0] == 0x00:
+                break
+            if slot[0] == 0xE5:
+                long_name = []
+                continue
+            if slot[11] == 0x0F:
+                part = slot[1:11] + slot[14:26] + slot[28:32]
+                long_name.insert(0, part.decode('utf-16-le').split('\x00')[0])
+                continue
+
+            attributes = slot[11]
+            first = struct.unpack_from('<H', slot, 20)[0] << 16 | struct.unpack_from('<H', slot, 26)[0]
+            size = struct.unpack_from('<I', slot, 28)[0]
+            base, extension = slot[0:8].decode('latin-1').rstrip(), slot[8:11].decode('latin-1').rstrip()
+            name = ''.join(long_name) or (base + '.' + extension if extension else base)
+            long_name = []
+
+            if attributes & 0x08:
+                continue
+            if name in ('.', '..'):
+                expected = (cluster if name == '.' else parent)
+                if bits == 32 and expected == root_cluster:
+                    expected = 0
+                if path == '' or first != expected:
+                    problems.append('%s: "%s" points to cluster %d instead of %d' % (path or '/', name, first, expected))
+                continue
+            if attributes & 0x10:
+                walk(first, path + '/' + name, cluster)
+            else:
+                content = read_chain(first, path + '/' + name) if first else b''
+                if len(content) != (size + bytes_per_cluster - 1) // bytes_per_cluster * bytes_per_cluster:
+                    problems.append('%s: %d bytes in %d clusters' % (path + '/' + name, size, len(content) // bytes_per_cluster))
+                files[path + '/' + name] = content[:size]
+
+    walk(root_cluster if bits == 32 else 0, '', 0)
+
+    free = 0
+    for cluster in range(2, clusters + 2):
+        if next_cluster(cluster) == 0:
+            free += 1
+        elif cluster not in owners:
+            problems.append('cluster %d is used but belongs to no file' % cluster)
+    if bits == 32:
+        recorded = struct.unpack_from('<I', image, fsinfo_sector * bytes_per_sector + 488)[0]
+        if recorded != 0xFFFFFFFF and recorded != free:
+            problems.append('FSInfo says %d clusters are free, the FAT has %d' % (recorded, free))
+
+    return files, directories, problems
@@ -0,0 +1,88 @@
+#!/usr/bin/env python3
+"""Builds a sparse FAT32 image of several TiB and checks that main.out can list it and read the files
+at the very end of the volume, which are more than 4 GiB (and 2 TiB) into the drive.
+
+usage: tests/huge_volume.py [path to main.out] [size in TiB]
+
+Only the boot sector, FSInfo, a few FAT entries and the clusters that are used are written, so the image
+takes a few hundred KiB on a filesystem that supports sparse files.
+"""
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+from fat_image import END_OF_CHAIN, FATImage, entry
+
+BYTES_PER_SECTOR = 4096  # 32-bit sector counts reach 16 TiB with 4K sectors
+SECTORS_PER_CLUSTER = 8
+TIME_LIMIT = 2  # seconds; the whole volume must not be scanned to find its last clusters
+
+
+def build(path, size):
+    image = FATImage(path, 32, size, BYTES_PER_SECTOR, SECTORS_PER_CLUSTER, root_cluster=-4)
+    last = image.clusters + 1
+    root, directory, middle = image.root_cluster, last - 2, image.clusters // 2
+    bytes_per_cluster = image.bytes_per_cluster
+
+    # END.TXT is in the last cluster, DIR/SPLIT.BIN starts in the middle of the volume and ends before END.TXT
+    end = b'the last cluster of the volume\n'
+    split = bytes((i * 7) % 251 for i in range(bytes_per_cluster + 1000))
+    for cluster, value in ((directory, END_OF_CHAIN[32]), (last, END_OF_CHAIN[32]), (middle, last - 1), (last - 1, END_OF_CHAIN[32])):
+        image.set_fat(cluster, value)
+
+    image.write(image.address(root), entry('END     TXT', 0x20, last, len(end)) + entry('DIR', 0x10, directory, 0))
+    image.write(image.address(directory), entry('.', 0x10, directory, 0) + entry('..', 0x10, 0, 0) +
+                entry('SPLIT   BIN', 0x20, middle, len(split)))
+    image.write(image.address(middle), split[:bytes_per_cluster])
+    image.write(image.address(last - 1), split[bytes_per_cluster:])
+    image.write(image.address(last), end)
+    image.close()
+    return end, split
+
+
+def run(program, image, commands):
+    start = time.time()
+    result = subprocess.run([program, image], input=('\n'.join(commands) + '\nexit\n').encode(),
+                            stdout=subprocess.PIPE, stderr=subprocess.STDOUT, timeout=60)
+    return result.stdout, time.time() - start
+
+
+def main():
+    program = sys.argv[1] if len(sys.argv) > 1 else './main.out'
+    size = float(sys.argv[2]) if len(sys.argv) > 2 else 6
+    failures = []
+
+    def check(condition, message):
+        print(('ok    ' if condition else 'FAIL  ') + message)
+        if not condition:
+            failures.append(message)
+
+    with tempfile.TemporaryDirectory() as directory:
+        image = os.path.join(directory, 'huge.img')
+        end, split = build(image, int(size * (1 << 40)))
+        print('%.1f TiB image, %d KiB on disk' % (size, os.stat(image).st_blocks // 2))
+
+        output, seconds = run(program, image, ['ls'])
+        check(b'Filesystem detected as FAT32' in output, 'detected as FAT32')
+        check(b'END     TXT' in output and b'DIR' in output, 'root directory at the end of the volume is listed')
+        check(seconds < TIME_LIMIT, 'listed in %.3f s' % seconds)
+
+        output, seconds = run(program, image, ['END     TXT'])
+        check(end + b'\nend of file' in output, 'file in the last cluster is read')
+        check(seconds < TIME_LIMIT, 'read in %.3f s' % seconds)
+
+        output, seconds = run(program, image, ['DIR', 'SPLIT   BIN'])
+        check(split + b'\nend of file' in output, 'file split between the middle and the end is read')
+        check(seconds < TIME_LIMIT, 'read in %.3f s' % seconds)
+
+    if failures:
+        print('%d of the checks failed' % len(failures))
+        return 1
+    print('all checks passed')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""Makes small FAT12, FAT16 and FAT32 images, changes them with main.out --write and checks what ends up on the disk:
+the files read back with the data that was written, the FAT copies are the same, no cluster is lost or used twice,
+and on FAT32 the free count in FSInfo matches the FAT.
+
+usage: tests/write_volume.py [path to main.out]
+"""
+import os
+import subprocess
+import sys
+import tempfile
+
+from fat_image import FATImage, read_volume
+
+# size of the volume and sectors per cluster; 512-byte clusters make directories grow quickly
+VOLUMES = {12: (1 << 20, 1), 16: (8 << 20, 1), 32: (40 << 20, 1)}
+
+
+def run(program, image, commands):
+    result = subprocess.run([program, image, '--write'], input=('\n'.join(commands) + '\nexit\n').encode(),
+                            stdout=subprocess.PIPE, stderr=subprocess.STDOUT, timeout=60)
+    return result.stdout
+
+
+def test(program, bits, directory, check):
+    size, sectors_per_cluster = VOLUMES[bits]
+    image = os.path.join(directory, 'fat%d.img' % bits)
+    volume = FATImage(image, bits, size, sectors_per_cluster=sectors_per_cluster)
+    bytes_per_cluster = volume.bytes_per_cluster
+    volume.close()
+
+    def source(name, data):
+        path = os.path.join(directory, name)
+        with open(path, 'wb') as f:
+            f.write(data)
+        return path
+
+    def pattern(length, seed):
+        return bytes((i * 7 + seed) % 251 for i in range(length))
+
+    expected = {}
+
+    hello = b'hello, world\n'
+    expected['/HELLO.TXT'] = hello
+    output = run(program, image, ['put', source('hello', hello), 'HELLO.TXT'])
+    check(b'Done' in output, 'FAT%d: put a small file' % bits)
+
+    # the first part of the appended data goes into the last cluster, the rest into new ones
+    big = pattern(bytes_per_cluster * 3 + 100, 1)
+    more = pattern(bytes_per_cluster + 300, 2)
+    expected['/big.bin'] = big + more
+    output = run(program, image, ['put', source('big', big), 'big.bin', 'append', source('more', more), 'big.bin'])
+    check(output.count(b'Done') == 2, 'FAT%d: put a file and append to it across a cluster boundary' % bits)
+
+    note = pattern(bytes_per_cluster * 2, 3)
+    expected['/DOCS/NOTE.TXT'] = note
+    output = run(program, image, ['mkdir', 'DOCS', 'mkdir', 'EMPTY', 'put', source('temp', note), 'TEMP.TXT'])
+    check(output.count(b'Done') == 3, 'FAT%d: make directories' % bits)
+    output = run(program, image, ['DOCS', 'put', source('note', note), 'NOTE.TXT'])
+    check(b'Done' in output, 'FAT%d: put a file in a directory' % bits)
+    output = run(program, image, ['rm', 'EMPTY', 'rm', 'TEMP.TXT'])
+    check(output.count(b'Done') == 2, 'FAT%d: remove a directory and a file' % bits)
+
+    # '.' and '..' are entries of the directory itself, removing them would free clusters that are still used
+    output = run(program, image, ['mkdir', 'KEEP', 'KEEP', 'rm', '.', 'rm', '..', 'mkdir', 'NEXT'])
+    check(output.count(b'cannot remove') == 2 and output.count(b'Done') == 2, 'FAT%d: "." and ".." are not removed' % bits)
+
+    # enough long names to make the directory several clusters long
+    tree = os.path.join(directory, 'tree%d' % bits)
+    os.makedirs(os.path.join(tree, 'LOTS', 'nested'))
+    names = ['imported file number %02d.txt' % i for i in range(40)] + ['café ünïcode ☕.txt']
+    for i, name in enumerate(names):
+        expected['/LOTS/' + name] = pattern(i * 37, i)
+        source(os.path.join(tree, 'LOTS', name), expected['/LOTS/' + name])
+    expected['/LOTS/nested/deep.txt'] = pattern(bytes_per_cluster + 1, 4)
+    source(os.path.join(tree, 'LOTS', 'nested', 'deep.txt'), expected['/LOTS/nested/deep.txt'])
+    # fsinfo leaves the stream in hex on FAT12/16, the counts must still be printed in decimal
+    output = run(program, image, ['fsinfo', 'import', tree])
+    check(b'Imported %d files and 2 directories.' % (len(names) + 1) in output and b'Done' in output,
+          'FAT%d: import a directory tree' % bits)
+
+    files, directories, problems = read_volume(image)
+    for problem in problems:
+        print('      ' + problem)
+    check(not problems, 'FAT%d: the FATs, the cluster chains and the free count are consistent' % bits)
+    check(files == expected, 'FAT%d: every file reads back with the data that was written' % bits)
+    check(sorted(directories) == ['/', '/DOCS', '/KEEP', '/KEEP/NEXT', '/LOTS', '/LOTS/nested'], 'FAT%d: the directories are the expected ones' % bits)
+
+
+def main():
+    program = sys.argv[1] if len(sys.argv) > 1 else './main.out'
+    failures = []
+
+    def check(condition, message):
+        print(('ok    ' if condition else 'FAIL  ') + message)
+        if not condition:
+            failures.append(message)
+
+    with tempfile.TemporaryDirectory() as directory:
+        for bits in sorted(VOLUMES):
+            test(program, bits, directory, check)
+
+    if failures:
+        print('%d of the checks failed' % len(failures))
+        return 1
+    print('all checks passed')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())